@@ -0,0 +1,279 @@
+// Micro-benchmarks for the jobsystem and the lock-free queues it's built on.
+// Each result is written to stdout as a single line JSON object, so results
+// can be collected and compared by scripts.
+//
+// Usage: job_system_benchmark [--filter <substring>] [--max-threads <count>] [--repeat <count>]
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "core/atomic_queue.h"
+#include "core/work_stealing_deque.h"
+#include "systems/job_system.h"
+
+using namespace cyb;
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Options
+    {
+        std::string filter;
+        uint32_t maxThreads{ std::max(1u, std::thread::hardware_concurrency() - 1) };
+        uint32_t repeat{ 5 };
+    };
+
+    Options options;
+
+    [[nodiscard]] double ElapsedNs(Clock::time_point start)
+    {
+        return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    }
+
+    [[nodiscard]] double Percentile(std::vector<double>& samples, double percentile)
+    {
+        std::sort(samples.begin(), samples.end());
+        const size_t index = std::min(samples.size() - 1, (size_t)(percentile * samples.size()));
+        return samples[index];
+    }
+
+    void Report(const std::string& name, uint32_t threads, uint64_t ops, std::vector<double>& nsPerOp)
+    {
+        const double median = Percentile(nsPerOp, 0.5);
+        std::printf("{\"name\":\"%s\",\"threads\":%u,\"ops\":%llu,\"ns_per_op\":%.2f,\"min_ns_per_op\":%.2f,\"p99_ns_per_op\":%.2f,\"ops_per_sec\":%.0f}\n",
+            name.c_str(), threads, (unsigned long long)ops, median, nsPerOp.front(), Percentile(nsPerOp, 0.99), 1e9 / median);
+        std::fflush(stdout);
+    }
+
+    [[nodiscard]] bool IsEnabled(const std::string& name)
+    {
+        return options.filter.empty() || name.find(options.filter) != std::string::npos;
+    }
+
+    // Run body options.repeat times, where body returns the elapsed time in
+    // nanoseconds for executing ops operations.
+    template <typename F>
+    void Run(const std::string& name, uint32_t threads, uint64_t ops, F&& body)
+    {
+        if (!IsEnabled(name))
+            return;
+
+        std::vector<double> nsPerOp;
+        for (uint32_t i = 0; i < options.repeat; ++i)
+            nsPerOp.push_back(body() / (double)ops);
+        Report(name, threads, ops, nsPerOp);
+    }
+
+    // Start all threads at once and return the time until all of them are finished.
+    template <typename F>
+    [[nodiscard]] double RunThreads(uint32_t threadCount, F&& func)
+    {
+        std::atomic<uint32_t> readyCount{ 0 };
+        std::atomic<bool> start{ false };
+        std::vector<std::thread> threads;
+        for (uint32_t i = 0; i < threadCount; ++i)
+        {
+            threads.emplace_back([&, i] {
+                readyCount.fetch_add(1);
+                while (!start.load(std::memory_order_acquire))
+                    std::this_thread::yield();
+                func(i);
+            });
+        }
+
+        while (readyCount.load() < threadCount)
+            std::this_thread::yield();
+
+        const Clock::time_point startTime = Clock::now();
+        start.store(true, std::memory_order_release);
+        for (auto& thread : threads)
+            thread.join();
+        return ElapsedNs(startTime);
+    }
+
+    // Producers and consumers hammering a bounded MPMC queue, half of the
+    // threads are pushing and the other half are popping.
+    void BenchmarkAtomicQueue(uint32_t threadCount)
+    {
+        constexpr uint64_t ITEM_COUNT = 1 << 20;
+        using Queue = AtomicCircularQueue<uint64_t, 4096>;
+
+        Run("atomic_queue_push_pop", threadCount, ITEM_COUNT, [&] {
+            auto queue = std::make_unique<Queue>();
+            if (threadCount == 1)
+            {
+                const Clock::time_point startTime = Clock::now();
+                for (uint64_t i = 0; i < ITEM_COUNT; ++i)
+                {
+                    queue->Push(uint64_t(i));
+                    (void)queue->Pop();
+                }
+                return ElapsedNs(startTime);
+            }
+
+            const uint32_t producerCount = threadCount / 2;
+            std::atomic<uint64_t> popCount{ 0 };
+            return RunThreads(threadCount, [&] (uint32_t threadIndex) {
+                if (threadIndex < producerCount)
+                {
+                    for (uint64_t i = threadIndex; i < ITEM_COUNT; i += producerCount)
+                    {
+                        while (!queue->Push(uint64_t(i)))
+                            std::this_thread::yield();
+                    }
+                    return;
+                }
+
+                while (popCount.load(std::memory_order_relaxed) < ITEM_COUNT)
+                {
+                    if (queue->Pop())
+                        popCount.fetch_add(1, std::memory_order_relaxed);
+                }
+            });
+        });
+    }
+
+    // The owner pushing and popping in batches while all other threads are
+    // stealing, like the jobsystem queues under load.
+    void BenchmarkWorkStealingDeque(uint32_t threadCount)
+    {
+        constexpr uint64_t ITEM_COUNT = 1 << 20;
+        constexpr uint64_t BATCH_SIZE = 64;
+
+        Run("work_stealing_deque_push_pop_steal", threadCount, ITEM_COUNT, [&] {
+            WorkStealingDeque<uint64_t> deque;
+            std::atomic<uint64_t> takenCount{ 0 };
+            return RunThreads(threadCount, [&] (uint32_t threadIndex) {
+                if (threadIndex == 0)
+                {
+                    for (uint64_t i = 0; i < ITEM_COUNT; i += BATCH_SIZE)
+                    {
+                        for (uint64_t j = 0; j < BATCH_SIZE; ++j)
+                            deque.Push(i + j);
+                        while (deque.Pop())
+                            takenCount.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    return;
+                }
+
+                while (takenCount.load(std::memory_order_relaxed) < ITEM_COUNT)
+                {
+                    if (deque.Steal())
+                        takenCount.fetch_add(1, std::memory_order_relaxed);
+                }
+            });
+        });
+    }
+
+    // Benchmarks of the jobsystem using threadCount worker threads.
+    void BenchmarkJobSystem(uint32_t threadCount)
+    {
+        constexpr uint32_t JOB_COUNT = 1 << 16;
+        constexpr uint32_t WAIT_ROUNDS = 2000;
+        constexpr uint32_t WORK_ITEM_COUNT = 1 << 16;
+
+        jobsystem::Initialize(threadCount);
+        threadCount = jobsystem::GetThreadCount();
+
+        Run("execute_empty", threadCount, JOB_COUNT, [&] {
+            jobsystem::Context ctx;
+            const Clock::time_point startTime = Clock::now();
+            for (uint32_t i = 0; i < JOB_COUNT; ++i)
+                jobsystem::Execute(ctx, [] (jobsystem::JobArgs) {});
+            jobsystem::Wait(ctx);
+            return ElapsedNs(startTime);
+        });
+
+        for (uint32_t groupSize : { 1u, 64u })
+        {
+            Run("dispatch_empty_group" + std::to_string(groupSize), threadCount, JOB_COUNT, [&] {
+                jobsystem::Context ctx;
+                const Clock::time_point startTime = Clock::now();
+                jobsystem::Dispatch(ctx, JOB_COUNT, groupSize, [] (jobsystem::JobArgs) {});
+                jobsystem::Wait(ctx);
+                return ElapsedNs(startTime);
+            });
+        }
+
+        // Round trip of a single job executed by a worker: submit, wake up
+        // the worker, execute and wake up the waiting thread.
+        const std::string waitLatencyName = "wait_latency";
+        if (IsEnabled(waitLatencyName))
+        {
+            std::vector<double> samples;
+            samples.reserve(WAIT_ROUNDS);
+            jobsystem::Context ctx;
+            ctx.allowWorkOnMainThread = false;
+            for (uint32_t i = 0; i < WAIT_ROUNDS; ++i)
+            {
+                const Clock::time_point startTime = Clock::now();
+                jobsystem::Execute(ctx, [] (jobsystem::JobArgs) {});
+                jobsystem::Wait(ctx);
+                samples.push_back(ElapsedNs(startTime));
+            }
+            Report(waitLatencyName, threadCount, WAIT_ROUNDS, samples);
+        }
+
+        // Fixed amount of cpu bound work, for measuring how the jobsystem
+        // scales with the number of threads.
+        Run("parallel_for_work", threadCount, WORK_ITEM_COUNT, [&] {
+            jobsystem::Context ctx;
+            std::atomic<uint64_t> result{ 0 };
+            const Clock::time_point startTime = Clock::now();
+            jobsystem::ParallelFor(ctx, WORK_ITEM_COUNT, [&] (jobsystem::JobArgs args) {
+                uint64_t x = args.jobIndex + 1;
+                for (uint32_t i = 0; i < 1000; ++i)
+                    x = x * 6364136223846793005ull + 1442695040888963407ull;
+                if (x == 0)
+                    result.fetch_add(1, std::memory_order_relaxed);
+            });
+            jobsystem::Wait(ctx);
+            return ElapsedNs(startTime);
+        });
+
+        jobsystem::Shutdown();
+    }
+
+    bool ParseOptions(int argc, char* argv[])
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+            const bool hasValue = i + 1 < argc;
+            if (arg == "--filter" && hasValue)
+                options.filter = argv[++i];
+            else if (arg == "--max-threads" && hasValue)
+                options.maxThreads = std::max(1, std::atoi(argv[++i]));
+            else if (arg == "--repeat" && hasValue)
+                options.repeat = std::max(1, std::atoi(argv[++i]));
+            else
+                return false;
+        }
+
+        return true;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (!ParseOptions(argc, argv))
+    {
+        std::fprintf(stderr, "Usage: %s [--filter <substring>] [--max-threads <count>] [--repeat <count>]\n", argv[0]);
+        return 1;
+    }
+
+    for (uint32_t threadCount = 1; threadCount <= options.maxThreads; ++threadCount)
+    {
+        BenchmarkAtomicQueue(threadCount);
+        BenchmarkWorkStealingDeque(threadCount);
+        BenchmarkJobSystem(threadCount);
+    }
+
+    return 0;
+}
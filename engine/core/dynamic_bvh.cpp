@@ -0,0 +1,266 @@
+#include <algorithm>
+#include "core/dynamic_bvh.h"
+
+namespace cyb
+{
+    [[nodiscard]] static AxisAlignedBox Union(const AxisAlignedBox& a, const AxisAlignedBox& b)
+    {
+        return AxisAlignedBox{ XMVectorMin(a.GetMin(), b.GetMin()), XMVectorMax(a.GetMax(), b.GetMax()) };
+    }
+
+    [[nodiscard]] static float SurfaceArea(const AxisAlignedBox& aabb)
+    {
+        XMFLOAT3 e;
+        XMStoreFloat3(&e, XMVectorSubtract(aabb.GetMax(), aabb.GetMin()));
+        return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+
+    [[nodiscard]] static bool Contains(const AxisAlignedBox& outer, const AxisAlignedBox& inner)
+    {
+        return XMVector3LessOrEqual(outer.GetMin(), inner.GetMin()) &&
+            XMVector3GreaterOrEqual(outer.GetMax(), inner.GetMax());
+    }
+
+    [[nodiscard]] static AxisAlignedBox Expand(const AxisAlignedBox& aabb, float margin)
+    {
+        const XMVECTOR m = XMVectorReplicate(margin);
+        return AxisAlignedBox{ XMVectorSubtract(aabb.GetMin(), m), XMVectorAdd(aabb.GetMax(), m) };
+    }
+
+    uint32_t DynamicBVH::Insert(const AxisAlignedBox& aabb, uint32_t userData)
+    {
+        const uint32_t proxy = AllocateNode();
+        Node& node = m_nodes[proxy];
+        node.aabb = Expand(aabb, m_margin);
+        node.userData = userData;
+        node.height = 0;
+        InsertLeaf(proxy);
+        m_leafCount++;
+        return proxy;
+    }
+
+    void DynamicBVH::Remove(uint32_t proxy)
+    {
+        assert(proxy < m_nodes.size() && m_nodes[proxy].IsLeaf());
+        RemoveLeaf(proxy);
+        FreeNode(proxy);
+        m_leafCount--;
+    }
+
+    bool DynamicBVH::Update(uint32_t proxy, const AxisAlignedBox& aabb)
+    {
+        assert(proxy < m_nodes.size() && m_nodes[proxy].IsLeaf());
+
+        // Keep the leaf where it is as long as the fat box still fits, but
+        // don't let a shrunk box keep a huge fat box around.
+        const AxisAlignedBox& fatAABB = m_nodes[proxy].aabb;
+        if (Contains(fatAABB, aabb) && Contains(Expand(aabb, m_margin * 4.0f), fatAABB))
+            return false;
+
+        RemoveLeaf(proxy);
+        m_nodes[proxy].aabb = Expand(aabb, m_margin);
+        InsertLeaf(proxy);
+        return true;
+    }
+
+    void DynamicBVH::Clear()
+    {
+        m_nodes.clear();
+        m_root = INVALID_NODE;
+        m_freeList = INVALID_NODE;
+        m_leafCount = 0;
+    }
+
+    uint32_t DynamicBVH::AllocateNode()
+    {
+        uint32_t index;
+        if (m_freeList != INVALID_NODE)
+        {
+            index = m_freeList;
+            m_freeList = m_nodes[index].parent;
+            m_nodes[index] = Node{};
+        }
+        else
+        {
+            assert(m_nodes.size() < INSIDE_BIT);
+            index = (uint32_t)m_nodes.size();
+            m_nodes.emplace_back();
+        }
+
+        return index;
+    }
+
+    void DynamicBVH::FreeNode(uint32_t index)
+    {
+        Node& node = m_nodes[index];
+        node.parent = m_freeList;
+        node.height = -1;
+        m_freeList = index;
+    }
+
+    void DynamicBVH::InsertLeaf(uint32_t leaf)
+    {
+        if (m_root == INVALID_NODE)
+        {
+            m_root = leaf;
+            m_nodes[leaf].parent = INVALID_NODE;
+            return;
+        }
+
+        // Walk down the tree picking the child with the lowest cost, until
+        // making a new parent for the current node is the cheapest option.
+        const AxisAlignedBox leafAABB = m_nodes[leaf].aabb;
+        uint32_t index = m_root;
+        while (!m_nodes[index].IsLeaf())
+        {
+            const Node& node = m_nodes[index];
+            const float area = SurfaceArea(node.aabb);
+            const float combinedArea = SurfaceArea(Union(node.aabb, leafAABB));
+
+            // Cost of creating a new parent for this node and the new leaf,
+            // and the minimum cost of pushing the leaf further down the tree.
+            const float cost = 2.0f * combinedArea;
+            const float inheritanceCost = 2.0f * (combinedArea - area);
+
+            float childCost[2];
+            for (uint32_t i = 0; i < 2; ++i)
+            {
+                const Node& child = m_nodes[node.child[i]];
+                childCost[i] = SurfaceArea(Union(child.aabb, leafAABB)) + inheritanceCost;
+                if (!child.IsLeaf())
+                    childCost[i] -= SurfaceArea(child.aabb);
+            }
+
+            if (cost < childCost[0] && cost < childCost[1])
+                break;
+
+            index = childCost[0] < childCost[1] ? node.child[0] : node.child[1];
+        }
+
+        // Create a new parent for the sibling and the leaf.
+        const uint32_t sibling = index;
+        const uint32_t oldParent = m_nodes[sibling].parent;
+        const uint32_t newParent = AllocateNode();
+        m_nodes[newParent].parent = oldParent;
+        m_nodes[newParent].aabb = Union(leafAABB, m_nodes[sibling].aabb);
+        m_nodes[newParent].height = m_nodes[sibling].height + 1;
+        m_nodes[newParent].child[0] = sibling;
+        m_nodes[newParent].child[1] = leaf;
+        m_nodes[sibling].parent = newParent;
+        m_nodes[leaf].parent = newParent;
+
+        if (oldParent != INVALID_NODE)
+        {
+            Node& parent = m_nodes[oldParent];
+            parent.child[parent.child[0] == sibling ? 0 : 1] = newParent;
+        }
+        else
+        {
+            m_root = newParent;
+        }
+
+        RefitAncestors(m_nodes[leaf].parent);
+    }
+
+    void DynamicBVH::RemoveLeaf(uint32_t leaf)
+    {
+        if (leaf == m_root)
+        {
+            m_root = INVALID_NODE;
+            return;
+        }
+
+        // Replace the parent with the sibling.
+        const uint32_t parent = m_nodes[leaf].parent;
+        const uint32_t grandParent = m_nodes[parent].parent;
+        const uint32_t sibling = m_nodes[parent].child[m_nodes[parent].child[0] == leaf ? 1 : 0];
+        FreeNode(parent);
+        m_nodes[sibling].parent = grandParent;
+
+        if (grandParent == INVALID_NODE)
+        {
+            m_root = sibling;
+            return;
+        }
+
+        Node& node = m_nodes[grandParent];
+        node.child[node.child[0] == parent ? 0 : 1] = sibling;
+        RefitAncestors(grandParent);
+    }
+
+    void DynamicBVH::RefitAncestors(uint32_t index)
+    {
+        while (index != INVALID_NODE)
+        {
+            index = Balance(index);
+
+            Node& node = m_nodes[index];
+            const Node& child0 = m_nodes[node.child[0]];
+            const Node& child1 = m_nodes[node.child[1]];
+            node.height = 1 + std::max(child0.height, child1.height);
+            node.aabb = Union(child0.aabb, child1.aabb);
+
+            index = node.parent;
+        }
+    }
+
+    // Rotate the taller child of node A up if the tree is unbalanced, and
+    // return the index of the node that took the place of A.
+    //
+    //       A             C
+    //      / \           / \
+    //     B   C   =>    A   F
+    //        / \       / \
+    //       F   G     B   G
+    uint32_t DynamicBVH::Balance(uint32_t indexA)
+    {
+        Node& A = m_nodes[indexA];
+        if (A.IsLeaf() || A.height < 2)
+            return indexA;
+
+        const int32_t balance = m_nodes[A.child[1]].height - m_nodes[A.child[0]].height;
+        if (balance >= -1 && balance <= 1)
+            return indexA;
+
+        // Rotate child C up, keeping B as the other child of A.
+        const uint32_t side = balance > 1 ? 1 : 0;
+        const uint32_t indexB = A.child[side ^ 1];
+        const uint32_t indexC = A.child[side];
+        Node& B = m_nodes[indexB];
+        Node& C = m_nodes[indexC];
+        const uint32_t indexF = C.child[0];
+        const uint32_t indexG = C.child[1];
+        Node& F = m_nodes[indexF];
+        Node& G = m_nodes[indexG];
+
+        // Swap A and C.
+        C.child[0] = indexA;
+        C.parent = A.parent;
+        A.parent = indexC;
+        if (C.parent != INVALID_NODE)
+        {
+            Node& parent = m_nodes[C.parent];
+            parent.child[parent.child[0] == indexA ? 0 : 1] = indexC;
+        }
+        else
+        {
+            m_root = indexC;
+        }
+
+        // The taller grandchild stays with C, the other one moves to A.
+        const bool keepF = F.height > G.height;
+        const uint32_t indexKeep = keepF ? indexF : indexG;
+        const uint32_t indexMove = keepF ? indexG : indexF;
+        Node& keep = m_nodes[indexKeep];
+        Node& move = m_nodes[indexMove];
+        C.child[1] = indexKeep;
+        A.child[side] = indexMove;
+        move.parent = indexA;
+
+        A.aabb = Union(B.aabb, move.aabb);
+        A.height = 1 + std::max(B.height, move.height);
+        C.aabb = Union(A.aabb, keep.aabb);
+        C.height = 1 + std::max(A.height, keep.height);
+        return indexC;
+    }
+} // namespace cyb
@@ -0,0 +1,202 @@
+#pragma once
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+#include "core/intersect.h"
+
+namespace cyb
+{
+    /**
+     * @brief Dynamic bounding volume hierarchy over axis aligned boxes.
+     *
+     * Leaves are stored with a box fattened by a margin, so small movements
+     * don't change the tree at all. New leaves are inserted next to the
+     * sibling with the lowest surface area cost, and the tree is kept balanced
+     * with rotations, so inserts, removals and updates are O(log n).
+     *
+     * Queries report the user data of every leaf whose fattened box passes
+     * the test, test the exact bounds if false positives matter. Queries may
+     * run concurrently with each other, but not with any modifications.
+     */
+    class DynamicBVH
+    {
+    public:
+        static constexpr uint32_t INVALID_NODE = ~0u;
+
+        explicit DynamicBVH(float margin = 0.1f) :
+            m_margin(margin)
+        {
+        }
+
+        /**
+         * @brief Insert a leaf into the tree.
+         * @return Proxy of the leaf, used for updating or removing it.
+         */
+        [[nodiscard]] uint32_t Insert(const AxisAlignedBox& aabb, uint32_t userData);
+        void Remove(uint32_t proxy);
+
+        /**
+         * @brief Update the box of a leaf. The leaf is only reinserted if aabb
+         *        is outside the fattened box, or much smaller than it.
+         * @return true if the leaf was reinserted.
+         */
+        bool Update(uint32_t proxy, const AxisAlignedBox& aabb);
+
+        void Clear();
+
+        [[nodiscard]] uint32_t GetUserData(uint32_t proxy) const { return m_nodes[proxy].userData; }
+        void SetUserData(uint32_t proxy, uint32_t userData) { m_nodes[proxy].userData = userData; }
+        [[nodiscard]] const AxisAlignedBox& GetFatAABB(uint32_t proxy) const { return m_nodes[proxy].aabb; }
+        [[nodiscard]] uint32_t GetLeafCount() const { return m_leafCount; }
+        [[nodiscard]] uint32_t GetHeight() const { return m_root != INVALID_NODE ? (uint32_t)m_nodes[m_root].height : 0; }
+
+        // Invoke func(userData) for each leaf intersecting the frustum. Nodes
+        // fully inside the frustum are reported without testing their children.
+        template <typename F>
+        void QueryFrustum(const Frustum& frustum, F&& func) const
+        {
+            if (m_root == INVALID_NODE)
+                return;
+
+            std::array<uint32_t, MAX_STACK_SIZE> stack;
+            uint32_t stackSize = 0;
+            stack[stackSize++] = m_root;
+            while (stackSize > 0)
+            {
+                const uint32_t entry = stack[--stackSize];
+                const Node& node = m_nodes[entry & ~INSIDE_BIT];
+                bool inside = (entry & INSIDE_BIT) != 0;
+                if (!inside)
+                {
+                    if (!frustum.IntersectsBoundingBox(node.aabb))
+                        continue;
+                    inside = frustum.ContainsBoundingBox(node.aabb);
+                }
+
+                if (node.IsLeaf())
+                {
+                    func(node.userData);
+                    continue;
+                }
+
+                assert(stackSize + 2 <= MAX_STACK_SIZE);
+                stack[stackSize++] = node.child[0] | (inside ? INSIDE_BIT : 0);
+                stack[stackSize++] = node.child[1] | (inside ? INSIDE_BIT : 0);
+            }
+        }
+
+        // Invoke func(userData) for each leaf intersecting aabb.
+        template <typename F>
+        void QueryAABB(const AxisAlignedBox& aabb, F&& func) const
+        {
+            Query([&] (const AxisAlignedBox& box) { return box.Intersects(aabb); }, func);
+        }
+
+        // Invoke func(userData) for each leaf intersecting the sphere.
+        template <typename F>
+        void QuerySphere(const XMVECTOR& center, float radius, F&& func) const
+        {
+            Query([&] (const AxisAlignedBox& box) { return box.IntersectsSphere(center, radius); }, func);
+        }
+
+        // Invoke func(userData) for each leaf intersecting the ray.
+        template <typename F>
+        void QueryRay(const Ray& ray, F&& func) const
+        {
+            Query([&] (const AxisAlignedBox& box) { return ray.IntersectsBoundingBox(box); }, func);
+        }
+
+        // Invoke func(userData, laneMask) for each leaf intersecting any ray in
+        // the packet, where laneMask is the subset of activeMask hitting it.
+        template <typename F>
+        void QueryRayPacket(const RayPacket& packet, uint32_t activeMask, F&& func) const
+        {
+            if (m_root == INVALID_NODE || activeMask == 0)
+                return;
+
+            std::array<uint32_t, MAX_STACK_SIZE> stack;
+            std::array<uint32_t, MAX_STACK_SIZE> stackMasks;
+            uint32_t stackSize = 0;
+            stack[stackSize] = m_root;
+            stackMasks[stackSize++] = activeMask;
+            while (stackSize > 0)
+            {
+                --stackSize;
+                const Node& node = m_nodes[stack[stackSize]];
+                const uint32_t mask = stackMasks[stackSize] & packet.IntersectsBoundingBox(node.aabb);
+                if (mask == 0)
+                    continue;
+
+                if (node.IsLeaf())
+                {
+                    func(node.userData, mask);
+                    continue;
+                }
+
+                assert(stackSize + 2 <= MAX_STACK_SIZE);
+                for (uint32_t i = 0; i < 2; ++i)
+                {
+                    stack[stackSize] = node.child[i];
+                    stackMasks[stackSize++] = mask;
+                }
+            }
+        }
+
+    private:
+        // The tree is kept balanced, a height of 64 is never reached in practice.
+        static constexpr uint32_t MAX_STACK_SIZE = 64;
+        static constexpr uint32_t INSIDE_BIT = 1u << 31;
+
+        struct Node
+        {
+            AxisAlignedBox aabb;
+            uint32_t parent{ INVALID_NODE };    // next free node when on the free list
+            uint32_t child[2]{ INVALID_NODE, INVALID_NODE };
+            uint32_t userData{ 0 };
+            int32_t height{ 0 };                // 0 for leaves, -1 for free nodes
+
+            [[nodiscard]] bool IsLeaf() const { return child[0] == INVALID_NODE; }
+        };
+
+        template <typename T, typename F>
+        void Query(T&& test, F& func) const
+        {
+            if (m_root == INVALID_NODE)
+                return;
+
+            std::array<uint32_t, MAX_STACK_SIZE> stack;
+            uint32_t stackSize = 0;
+            stack[stackSize++] = m_root;
+            while (stackSize > 0)
+            {
+                const Node& node = m_nodes[stack[--stackSize]];
+                if (!test(node.aabb))
+                    continue;
+
+                if (node.IsLeaf())
+                {
+                    func(node.userData);
+                    continue;
+                }
+
+                assert(stackSize + 2 <= MAX_STACK_SIZE);
+                stack[stackSize++] = node.child[0];
+                stack[stackSize++] = node.child[1];
+            }
+        }
+
+        [[nodiscard]] uint32_t AllocateNode();
+        void FreeNode(uint32_t index);
+        void InsertLeaf(uint32_t leaf);
+        void RemoveLeaf(uint32_t leaf);
+        void RefitAncestors(uint32_t index);
+        [[nodiscard]] uint32_t Balance(uint32_t index);
+
+        float m_margin;
+        uint32_t m_root{ INVALID_NODE };
+        uint32_t m_freeList{ INVALID_NODE };
+        uint32_t m_leafCount{ 0 };
+        std::vector<Node> m_nodes;
+    };
+} // namespace cyb
@@ -115,11 +115,27 @@ namespace cyb
         return XMMatrixScalingFromVector(E) * XMMatrixTranslationFromVector(C);
     }
 
+    bool AxisAlignedBox::IsValid() const
+    {
+        return XMVector3LessOrEqual(m_min, m_max) && !XMVector3IsInfinite(m_min) && !XMVector3IsInfinite(m_max);
+    }
+
     bool AxisAlignedBox::ContainsPoint(const XMVECTOR& p) const
     {
         return XMVector3GreaterOrEqual(p, m_min) && XMVector3LessOrEqual(p, m_max);
     }
 
+    bool AxisAlignedBox::Intersects(const AxisAlignedBox& other) const
+    {
+        return XMVector3LessOrEqual(m_min, other.m_max) && XMVector3LessOrEqual(other.m_min, m_max);
+    }
+
+    bool AxisAlignedBox::IntersectsSphere(const XMVECTOR& center, float radius) const
+    {
+        const XMVECTOR closest = XMVectorClamp(center, m_min, m_max);
+        return XMVectorGetX(XMVector3LengthSq(XMVectorSubtract(center, closest))) <= radius * radius;
+    }
+
     void AxisAlignedBox::Serialize(Serializer& s)
     {
         // serialize minmax vectors as XMFLOAT3
@@ -175,6 +191,56 @@ namespace cyb
         return DirectX::Internal::XMVector3AnyTrue(NoIntersection) == 0;
     }
 
+    RayPacket::RayPacket(const XMVECTOR origins[4], const XMVECTOR directions[4])
+    {
+        XMMATRIX o(origins[0], origins[1], origins[2], origins[3]);
+        XMMATRIX d(directions[0], directions[1], directions[2], directions[3]);
+        o = XMMatrixTranspose(o);
+        d = XMMatrixTranspose(d);
+        for (uint32_t i = 0; i < 3; ++i)
+        {
+            origin[i] = o.r[i];
+            direction[i] = d.r[i];
+            invDirection[i] = XMVectorReciprocal(d.r[i]);
+        }
+    }
+
+    uint32_t RayPacket::IntersectsBoundingBox(const XMVECTOR& boxMin, const XMVECTOR& boxMax, const XMVECTOR& maxDistance, XMVECTOR& entryDistance) const
+    {
+        const XMVECTOR boxMinAxis[3] = { XMVectorSplatX(boxMin), XMVectorSplatY(boxMin), XMVectorSplatZ(boxMin) };
+        const XMVECTOR boxMaxAxis[3] = { XMVectorSplatX(boxMax), XMVectorSplatY(boxMax), XMVectorSplatZ(boxMax) };
+
+        XMVECTOR tmin = XMVectorZero();
+        XMVECTOR tmax = maxDistance;
+        for (uint32_t i = 0; i < 3; ++i)
+        {
+            const XMVECTOR t1 = XMVectorMultiply(XMVectorSubtract(boxMinAxis[i], origin[i]), invDirection[i]);
+            const XMVECTOR t2 = XMVectorMultiply(XMVectorSubtract(boxMaxAxis[i], origin[i]), invDirection[i]);
+            tmin = XMVectorMax(tmin, XMVectorMin(t1, t2));
+            tmax = XMVectorMin(tmax, XMVectorMax(t1, t2));
+        }
+
+        entryDistance = tmin;
+        return GetLaneMask(XMVectorLessOrEqual(tmin, tmax));
+    }
+
+    uint32_t RayPacket::IntersectsBoundingBox(const AxisAlignedBox& aabb) const
+    {
+        XMVECTOR entryDistance;
+        return IntersectsBoundingBox(aabb.GetMin(), aabb.GetMax(), XMVectorReplicate(FLT_MAX), entryDistance);
+    }
+
+    uint32_t GetLaneMask(const XMVECTOR& comparison)
+    {
+#if defined(_XM_SSE_INTRINSICS_)
+        return (uint32_t)_mm_movemask_ps(comparison);
+#else
+        XMUINT4 lanes;
+        XMStoreUInt4(&lanes, comparison);
+        return (lanes.x >> 31) | ((lanes.y >> 31) << 1) | ((lanes.z >> 31) << 2) | ((lanes.w >> 31) << 3);
+#endif
+    }
+
     Frustum::Frustum(const XMMATRIX& viewProjection)
     {
         const XMMATRIX mat = XMMatrixTranspose(viewProjection);
@@ -204,5 +270,22 @@ namespace cyb
 
         return true;
     }
-} // namespace cyb
 
+    bool Frustum::ContainsBoundingBox(const AxisAlignedBox& aabb) const
+    {
+        const XMVECTOR min = aabb.GetMin();
+        const XMVECTOR max = aabb.GetMax();
+        const XMVECTOR zero = XMVectorZero();
+
+        for (size_t p = 0; p < 6; ++p)
+        {
+            const XMVECTOR plane = planes[p];
+            XMVECTOR lt = XMVectorLess(plane, zero);
+            XMVECTOR nearestToPlane = XMVectorSelect(min, max, lt);
+            if (XMVectorGetX(XMPlaneDotCoord(plane, nearestToPlane)) < 0.0f)
+                return false;
+        }
+
+        return true;
+    }
+} // namespace cyb
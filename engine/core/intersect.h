@@ -29,7 +29,11 @@ namespace cyb
         [[nodiscard]] AxisAlignedBox Transform(const XMMATRIX& transform) const;
         [[nodiscard]] XMMATRIX GetAsBoxMatrix() const;
 
+        // A box is valid if it's finite and not inverted, as left by Invalidate().
+        [[nodiscard]] bool IsValid() const;
         [[nodiscard]] bool ContainsPoint(const XMVECTOR& p) const;
+        [[nodiscard]] bool Intersects(const AxisAlignedBox& other) const;
+        [[nodiscard]] bool IntersectsSphere(const XMVECTOR& center, float radius) const;
 
         void Serialize(Serializer& s);
 
@@ -54,12 +58,38 @@ namespace cyb
         XMVECTOR m_invDirection{};
     };
 
+    /**
+     * @brief Four rays in structure of arrays layout, for intersecting them
+     *        together using SIMD. Lane masks use bit n for ray n.
+     */
+    struct RayPacket
+    {
+        RayPacket() = default;
+        RayPacket(const XMVECTOR origins[4], const XMVECTOR directions[4]);
+
+        /**
+         * @brief Intersect the rays with a box, only counting hits within maxDistance.
+         * @param entryDistance Set to the distance where each ray enters the box.
+         * @return Lane mask of the rays intersecting the box.
+         */
+        [[nodiscard]] uint32_t IntersectsBoundingBox(const XMVECTOR& boxMin, const XMVECTOR& boxMax, const XMVECTOR& maxDistance, XMVECTOR& entryDistance) const;
+        [[nodiscard]] uint32_t IntersectsBoundingBox(const AxisAlignedBox& aabb) const;
+
+        XMVECTOR origin[3]{};           // x, y, z
+        XMVECTOR direction[3]{};
+        XMVECTOR invDirection[3]{};
+    };
+
+    // Get the lane mask of a comparison result, bit n set if lane n is true.
+    [[nodiscard]] uint32_t GetLaneMask(const XMVECTOR& comparison);
+
     struct Frustum
     {
         Frustum() = default;
         Frustum(const XMMATRIX& viewProjection);
 
         [[nodiscard]] bool IntersectsBoundingBox(const AxisAlignedBox& aabb) const;
+        [[nodiscard]] bool ContainsBoundingBox(const AxisAlignedBox& aabb) const;
 
         XMVECTOR planes[6]{};
     };
@@ -0,0 +1,396 @@
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cfloat>
+#include <utility>
+#include "core/triangle_bvh.h"
+
+namespace cyb
+{
+    namespace
+    {
+        struct Bounds
+        {
+            XMFLOAT3 min{ FLT_MAX, FLT_MAX, FLT_MAX };
+            XMFLOAT3 max{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+            void Grow(const XMFLOAT3& p)
+            {
+                min = XMFLOAT3(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+                max = XMFLOAT3(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+            }
+
+            void Grow(const Bounds& b)
+            {
+                min = XMFLOAT3(std::min(min.x, b.min.x), std::min(min.y, b.min.y), std::min(min.z, b.min.z));
+                max = XMFLOAT3(std::max(max.x, b.max.x), std::max(max.y, b.max.y), std::max(max.z, b.max.z));
+            }
+
+            [[nodiscard]] float SurfaceArea() const
+            {
+                const XMFLOAT3 e(max.x - min.x, max.y - min.y, max.z - min.z);
+                return e.x < 0.0f ? 0.0f : 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+            }
+        };
+
+        [[nodiscard]] float GetAxis(const XMFLOAT3& v, uint32_t axis)
+        {
+            return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+        }
+    }
+
+    void TriangleBVH::Build(std::span<const XMFLOAT3> positions, std::span<const uint32_t> indices, std::vector<uint32_t>&& triangleOffsets)
+    {
+        Clear();
+        m_triangles = std::move(triangleOffsets);
+        const uint32_t triangleCount = (uint32_t)m_triangles.size();
+        if (triangleCount == 0)
+            return;
+
+        // Triangle bounds and centroids, kept in the same order as m_triangles
+        // while partitioning.
+        std::vector<Bounds> triangleBounds(triangleCount);
+        std::vector<XMFLOAT3> centroids(triangleCount);
+        for (uint32_t i = 0; i < triangleCount; ++i)
+        {
+            Bounds& bounds = triangleBounds[i];
+            for (uint32_t j = 0; j < 3; ++j)
+                bounds.Grow(positions[indices[m_triangles[i] + j]]);
+            centroids[i] = XMFLOAT3(
+                (bounds.min.x + bounds.max.x) * 0.5f,
+                (bounds.min.y + bounds.max.y) * 0.5f,
+                (bounds.min.z + bounds.max.z) * 0.5f);
+        }
+
+        m_nodes.reserve((size_t)triangleCount * 2 - 1);
+        m_nodes.push_back(Node{ {}, 0, {}, triangleCount });
+
+        // Nodes to subdivide with their depth, which is limited so the
+        // queries never overflow their stack.
+        std::vector<std::pair<uint32_t, uint32_t>> stack;
+        stack.emplace_back(0, 0);
+        while (!stack.empty())
+        {
+            const auto [nodeIndex, depth] = stack.back();
+            stack.pop_back();
+
+            const uint32_t first = m_nodes[nodeIndex].first;
+            const uint32_t count = m_nodes[nodeIndex].count;
+            Bounds nodeBounds;
+            Bounds centroidBounds;
+            for (uint32_t i = first; i < first + count; ++i)
+            {
+                nodeBounds.Grow(triangleBounds[i]);
+                centroidBounds.Grow(centroids[i]);
+            }
+            m_nodes[nodeIndex].min = nodeBounds.min;
+            m_nodes[nodeIndex].max = nodeBounds.max;
+
+            if (count <= MAX_LEAF_SIZE || depth + 2 >= MAX_STACK_SIZE)
+                continue;
+
+            // Find the cheapest split plane along any axis, binning triangles
+            // by centroid.
+            float bestCost = FLT_MAX;
+            uint32_t bestAxis = 0;
+            float bestSplit = 0.0f;
+            for (uint32_t axis = 0; axis < 3; ++axis)
+            {
+                const float axisMin = GetAxis(centroidBounds.min, axis);
+                const float axisMax = GetAxis(centroidBounds.max, axis);
+                if (axisMax <= axisMin)
+                    continue;
+
+                std::array<Bounds, BIN_COUNT> bins;
+                std::array<uint32_t, BIN_COUNT> binCounts{};
+                const float scale = BIN_COUNT / (axisMax - axisMin);
+                for (uint32_t i = first; i < first + count; ++i)
+                {
+                    const uint32_t bin = std::min(BIN_COUNT - 1, (uint32_t)((GetAxis(centroids[i], axis) - axisMin) * scale));
+                    bins[bin].Grow(triangleBounds[i]);
+                    binCounts[bin]++;
+                }
+
+                // Sweep from the right storing the cost of everything right of
+                // each plane, then from the left evaluating each plane.
+                std::array<float, BIN_COUNT - 1> rightCosts;
+                Bounds rightBounds;
+                uint32_t rightCount = 0;
+                for (uint32_t i = BIN_COUNT - 1; i > 0; --i)
+                {
+                    rightBounds.Grow(bins[i]);
+                    rightCount += binCounts[i];
+                    rightCosts[i - 1] = rightCount * rightBounds.SurfaceArea();
+                }
+
+                Bounds leftBounds;
+                uint32_t leftCount = 0;
+                for (uint32_t i = 0; i < BIN_COUNT - 1; ++i)
+                {
+                    leftBounds.Grow(bins[i]);
+                    leftCount += binCounts[i];
+                    const float cost = leftCount * leftBounds.SurfaceArea() + rightCosts[i];
+                    if (leftCount > 0 && leftCount < count && cost < bestCost)
+                    {
+                        bestCost = cost;
+                        bestAxis = axis;
+                        bestSplit = axisMin + (i + 1) / scale;
+                    }
+                }
+            }
+
+            // Keep the node as a leaf if no split is cheaper than testing all
+            // of it's triangles.
+            if (bestCost >= count * nodeBounds.SurfaceArea())
+                continue;
+
+            // Partition the triangles around the split plane.
+            uint32_t i = first;
+            uint32_t j = first + count;
+            while (i < j)
+            {
+                if (GetAxis(centroids[i], bestAxis) < bestSplit)
+                {
+                    ++i;
+                    continue;
+                }
+
+                --j;
+                std::swap(m_triangles[i], m_triangles[j]);
+                std::swap(triangleBounds[i], triangleBounds[j]);
+                std::swap(centroids[i], centroids[j]);
+            }
+
+            // Floating point rounding in the bin index may put all triangles
+            // on one side.
+            const uint32_t leftCount = i - first;
+            if (leftCount == 0 || leftCount == count)
+                continue;
+
+            const uint32_t left = (uint32_t)m_nodes.size();
+            m_nodes.push_back(Node{ {}, first, {}, leftCount });
+            m_nodes.push_back(Node{ {}, i, {}, count - leftCount });
+            m_nodes[nodeIndex].first = left;
+            m_nodes[nodeIndex].count = 0;
+            stack.emplace_back(left, depth + 1);
+            stack.emplace_back(left + 1, depth + 1);
+        }
+    }
+
+    void TriangleBVH::Clear()
+    {
+        m_nodes.clear();
+        m_triangles.clear();
+    }
+
+    // Return the distance to where the ray enters the node, or FLT_MAX if the
+    // node is missed or further away than maxDistance.
+    [[nodiscard]] static float IntersectNode(const XMFLOAT3& nodeMin, const XMFLOAT3& nodeMax, const XMVECTOR& origin, const XMVECTOR& invDirection, float maxDistance)
+    {
+        const XMVECTOR t1 = XMVectorMultiply(XMVectorSubtract(XMLoadFloat3(&nodeMin), origin), invDirection);
+        const XMVECTOR t2 = XMVectorMultiply(XMVectorSubtract(XMLoadFloat3(&nodeMax), origin), invDirection);
+        XMVECTOR tmin = XMVectorMin(t1, t2);
+        XMVECTOR tmax = XMVectorMax(t1, t2);
+        tmin = XMVectorMax(tmin, XMVectorMax(XMVectorSplatY(tmin), XMVectorSplatZ(tmin)));
+        tmax = XMVectorMin(tmax, XMVectorMin(XMVectorSplatY(tmax), XMVectorSplatZ(tmax)));
+
+        const float entry = std::max(XMVectorGetX(tmin), 0.0f);
+        const float exit = XMVectorGetX(tmax);
+        return entry <= exit && entry < maxDistance ? entry : FLT_MAX;
+    }
+
+    bool TriangleBVH::IntersectRay(
+        const XMVECTOR& origin,
+        const XMVECTOR& direction,
+        std::span<const XMFLOAT3> positions,
+        std::span<const uint32_t> indices,
+        float& distance) const
+    {
+        if (m_nodes.empty())
+            return false;
+
+        const XMVECTOR invDirection = XMVectorReciprocal(direction);
+        bool hit = false;
+
+        std::array<uint32_t, MAX_STACK_SIZE> stack;
+        uint32_t stackSize = 0;
+        if (IntersectNode(m_nodes[0].min, m_nodes[0].max, origin, invDirection, distance) != FLT_MAX)
+            stack[stackSize++] = 0;
+
+        while (stackSize > 0)
+        {
+            const Node& node = m_nodes[stack[--stackSize]];
+            if (node.count > 0)
+            {
+                for (uint32_t i = node.first; i < node.first + node.count; ++i)
+                {
+                    const uint32_t offset = m_triangles[i];
+                    const XMVECTOR p0 = XMLoadFloat3(&positions[indices[offset + 0]]);
+                    const XMVECTOR p1 = XMLoadFloat3(&positions[indices[offset + 1]]);
+                    const XMVECTOR p2 = XMLoadFloat3(&positions[indices[offset + 2]]);
+
+                    float triangleDistance;
+                    XMFLOAT2 bary;
+                    if (RayTriangleIntersects(origin, direction, p0, p1, p2, triangleDistance, bary) && triangleDistance < distance)
+                    {
+                        distance = triangleDistance;
+                        hit = true;
+                    }
+                }
+                continue;
+            }
+
+            // Visit the nearest child first, so hits in it can cull the other one.
+            uint32_t near = node.first;
+            uint32_t far = node.first + 1;
+            float nearDistance = IntersectNode(m_nodes[near].min, m_nodes[near].max, origin, invDirection, distance);
+            float farDistance = IntersectNode(m_nodes[far].min, m_nodes[far].max, origin, invDirection, distance);
+            if (farDistance < nearDistance)
+            {
+                std::swap(near, far);
+                std::swap(nearDistance, farDistance);
+            }
+
+            assert(stackSize + 2 <= MAX_STACK_SIZE);
+            if (farDistance != FLT_MAX)
+                stack[stackSize++] = far;
+            if (nearDistance != FLT_MAX)
+                stack[stackSize++] = near;
+        }
+
+        return hit;
+    }
+
+    // Moller-Trumbore intersection of four rays with a single triangle, in
+    // the same way as RayTriangleIntersects(). Returns the lane mask of rays
+    // hitting the triangle closer than distance, and their hit distance in t.
+    [[nodiscard]] static uint32_t IntersectTrianglePacket(const RayPacket& packet, const XMFLOAT3& p0, const XMFLOAT3& p1, const XMFLOAT3& p2, const XMVECTOR& distance, XMVECTOR& t)
+    {
+        const XMVECTOR e1[3] = { XMVectorReplicate(p1.x - p0.x), XMVectorReplicate(p1.y - p0.y), XMVectorReplicate(p1.z - p0.z) };
+        const XMVECTOR e2[3] = { XMVectorReplicate(p2.x - p0.x), XMVectorReplicate(p2.y - p0.y), XMVectorReplicate(p2.z - p0.z) };
+        const XMVECTOR* d = packet.direction;
+
+        // p = d x e2, det = e1 . p
+        const XMVECTOR p[3] = {
+            XMVectorSubtract(XMVectorMultiply(d[1], e2[2]), XMVectorMultiply(d[2], e2[1])),
+            XMVectorSubtract(XMVectorMultiply(d[2], e2[0]), XMVectorMultiply(d[0], e2[2])),
+            XMVectorSubtract(XMVectorMultiply(d[0], e2[1]), XMVectorMultiply(d[1], e2[0])) };
+        const XMVECTOR det = XMVectorAdd(XMVectorAdd(XMVectorMultiply(e1[0], p[0]), XMVectorMultiply(e1[1], p[1])), XMVectorMultiply(e1[2], p[2]));
+        const XMVECTOR invDet = XMVectorReciprocal(det);
+
+        // s = o - p0, u = (s . p) / det
+        const XMVECTOR s[3] = {
+            XMVectorSubtract(packet.origin[0], XMVectorReplicate(p0.x)),
+            XMVectorSubtract(packet.origin[1], XMVectorReplicate(p0.y)),
+            XMVectorSubtract(packet.origin[2], XMVectorReplicate(p0.z)) };
+        const XMVECTOR u = XMVectorMultiply(XMVectorAdd(XMVectorAdd(XMVectorMultiply(s[0], p[0]), XMVectorMultiply(s[1], p[1])), XMVectorMultiply(s[2], p[2])), invDet);
+
+        // q = s x e1, v = (d . q) / det, t = (e2 . q) / det
+        const XMVECTOR q[3] = {
+            XMVectorSubtract(XMVectorMultiply(s[1], e1[2]), XMVectorMultiply(s[2], e1[1])),
+            XMVectorSubtract(XMVectorMultiply(s[2], e1[0]), XMVectorMultiply(s[0], e1[2])),
+            XMVectorSubtract(XMVectorMultiply(s[0], e1[1]), XMVectorMultiply(s[1], e1[0])) };
+        const XMVECTOR v = XMVectorMultiply(XMVectorAdd(XMVectorAdd(XMVectorMultiply(d[0], q[0]), XMVectorMultiply(d[1], q[1])), XMVectorMultiply(d[2], q[2])), invDet);
+        t = XMVectorMultiply(XMVectorAdd(XMVectorAdd(XMVectorMultiply(e2[0], q[0]), XMVectorMultiply(e2[1], q[1])), XMVectorMultiply(e2[2], q[2])), invDet);
+
+        const XMVECTOR zero = XMVectorZero();
+        XMVECTOR hit = XMVectorGreaterOrEqual(XMVectorAbs(det), g_RayEpsilon);
+        hit = XMVectorAndInt(hit, XMVectorGreaterOrEqual(u, zero));
+        hit = XMVectorAndInt(hit, XMVectorGreaterOrEqual(v, zero));
+        hit = XMVectorAndInt(hit, XMVectorLessOrEqual(XMVectorAdd(u, v), XMVectorSplatOne()));
+        hit = XMVectorAndInt(hit, XMVectorGreaterOrEqual(t, zero));
+        hit = XMVectorAndInt(hit, XMVectorLess(t, distance));
+        return GetLaneMask(hit);
+    }
+
+    uint32_t TriangleBVH::IntersectRayPacket(
+        const RayPacket& packet,
+        uint32_t activeMask,
+        std::span<const XMFLOAT3> positions,
+        std::span<const uint32_t> indices,
+        XMVECTOR& distance) const
+    {
+        if (m_nodes.empty() || activeMask == 0)
+            return 0;
+
+        auto intersectNode = [&] (uint32_t index, XMVECTOR& entryDistance) {
+            const Node& node = m_nodes[index];
+            return packet.IntersectsBoundingBox(XMLoadFloat3(&node.min), XMLoadFloat3(&node.max), distance, entryDistance);
+        };
+
+        // Each stack entry holds the rays entering the node.
+        std::array<uint32_t, MAX_STACK_SIZE> stack;
+        std::array<uint32_t, MAX_STACK_SIZE> stackMasks;
+        uint32_t stackSize = 0;
+        XMVECTOR entryDistance;
+        const uint32_t rootMask = activeMask & intersectNode(0, entryDistance);
+        if (rootMask != 0)
+        {
+            stack[stackSize] = 0;
+            stackMasks[stackSize++] = rootMask;
+        }
+
+        uint32_t hitMask = 0;
+        while (stackSize > 0)
+        {
+            --stackSize;
+            const Node& node = m_nodes[stack[stackSize]];
+            const uint32_t nodeMask = stackMasks[stackSize];
+            if (node.count > 0)
+            {
+                for (uint32_t i = node.first; i < node.first + node.count; ++i)
+                {
+                    const uint32_t offset = m_triangles[i];
+                    XMVECTOR t;
+                    const uint32_t mask = nodeMask & IntersectTrianglePacket(packet,
+                        positions[indices[offset + 0]],
+                        positions[indices[offset + 1]],
+                        positions[indices[offset + 2]],
+                        distance, t);
+                    if (mask == 0)
+                        continue;
+
+                    const XMVECTOR select = XMVectorSelectControl(mask & 1, (mask >> 1) & 1, (mask >> 2) & 1, (mask >> 3) & 1);
+                    distance = XMVectorSelect(distance, t, select);
+                    hitMask |= mask;
+                }
+                continue;
+            }
+
+            uint32_t near = node.first;
+            uint32_t far = node.first + 1;
+            XMVECTOR nearEntry;
+            XMVECTOR farEntry;
+            uint32_t nearMask = nodeMask & intersectNode(near, nearEntry);
+            uint32_t farMask = nodeMask & intersectNode(far, farEntry);
+            if ((nearMask | farMask) == 0)
+                continue;
+
+            // Visit the child entered first by the first ray entering any of
+            // them first, so its hits can cull the other one.
+            const uint32_t lane = (uint32_t)std::countr_zero(nearMask | farMask);
+            const bool nearHit = (nearMask >> lane) & 1;
+            const bool farHit = (farMask >> lane) & 1;
+            if (farHit && (!nearHit || XMVectorGetByIndex(farEntry, lane) < XMVectorGetByIndex(nearEntry, lane)))
+            {
+                std::swap(near, far);
+                std::swap(nearMask, farMask);
+            }
+
+            assert(stackSize + 2 <= MAX_STACK_SIZE);
+            if (farMask != 0)
+            {
+                stack[stackSize] = far;
+                stackMasks[stackSize++] = farMask;
+            }
+            if (nearMask != 0)
+            {
+                stack[stackSize] = near;
+                stackMasks[stackSize++] = nearMask;
+            }
+        }
+
+        return hitMask;
+    }
+} // namespace cyb
@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+#include <span>
+#include <vector>
+#include "core/intersect.h"
+
+namespace cyb
+{
+    /**
+     * @brief Static bounding volume hierarchy over the triangles of a mesh,
+     *        for fast ray intersection.
+     *
+     * Built top down using binned surface area heuristic splits. The tree only
+     * stores the index offset of each triangle, so the same vertex positions
+     * and indices used for building must be passed to the queries.
+     */
+    class TriangleBVH
+    {
+    public:
+        /**
+         * @brief Build the tree, replacing any previous one.
+         * @param triangleOffsets Offset into indices of the first index of each triangle to include.
+         */
+        void Build(std::span<const XMFLOAT3> positions, std::span<const uint32_t> indices, std::vector<uint32_t>&& triangleOffsets);
+        void Clear();
+
+        [[nodiscard]] bool IsEmpty() const { return m_nodes.empty(); }
+        [[nodiscard]] size_t GetNodeCount() const { return m_nodes.size(); }
+
+        /**
+         * @brief Find the closest triangle hit by a ray.
+         * @param direction Normalized ray direction.
+         * @param distance Only hits closer than distance are considered, set
+         *        to the distance of the closest hit on return.
+         * @return true if a triangle closer than distance was hit.
+         */
+        [[nodiscard]] bool IntersectRay(
+            const XMVECTOR& origin,
+            const XMVECTOR& direction,
+            std::span<const XMFLOAT3> positions,
+            std::span<const uint32_t> indices,
+            float& distance) const;
+
+        /**
+         * @brief Find the closest triangle hit by each ray in a packet.
+         * @param packet Rays with normalized directions.
+         * @param activeMask Lane mask of the rays to intersect.
+         * @param distance Per ray, only hits closer than distance are considered,
+         *        set to the distance of the closest hit on return.
+         * @return Lane mask of the rays hitting a triangle closer than distance.
+         */
+        [[nodiscard]] uint32_t IntersectRayPacket(
+            const RayPacket& packet,
+            uint32_t activeMask,
+            std::span<const XMFLOAT3> positions,
+            std::span<const uint32_t> indices,
+            XMVECTOR& distance) const;
+
+    private:
+        static constexpr uint32_t MAX_LEAF_SIZE = 4;
+        static constexpr uint32_t BIN_COUNT = 12;
+        static constexpr uint32_t MAX_STACK_SIZE = 64;
+
+        // Leaves have count > 0 and hold m_triangles[first, first + count),
+        // inner nodes have their two children at first and first + 1.
+        struct Node
+        {
+            XMFLOAT3 min;
+            uint32_t first;
+            XMFLOAT3 max;
+            uint32_t count;
+        };
+
+        std::vector<Node> m_nodes;
+        std::vector<uint32_t> m_triangles;  // triangle index offsets, ordered by leaf
+    };
+} // namespace cyb
@@ -0,0 +1,172 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+namespace cyb
+{
+    /**
+     * @brief A lock-free, unbounded Chase-Lev work-stealing deque.
+     *
+     * The owning thread pushes and pops at the bottom (LIFO), while any other
+     * thread may steal from the top (FIFO). When the ring buffer is full it's
+     * doubled in size. Retired buffers are kept alive until the deque is
+     * destroyed, as a thief might still be reading from them.
+     *
+     * Based on "Correct and Efficient Work-Stealing for Weak Memory Models"
+     * by N.M. Lê, A. Pop, A. Cohen and F.Z. Nardelli (2013).
+     */
+    template<typename T>
+    class WorkStealingDeque
+    {
+    public:
+        static_assert(std::is_trivially_copyable_v<T>, "T must be trivially copyable (store a pointer or handle)");
+
+        explicit WorkStealingDeque(size_t initialCapacity = 256)
+        {
+            size_t capacity = 2;
+            while (capacity < initialCapacity)
+                capacity <<= 1;
+
+            m_garbage.emplace_back(std::make_unique<Buffer>(capacity));
+            m_buffer.store(m_garbage.back().get(), std::memory_order_relaxed);
+        }
+
+        WorkStealingDeque(const WorkStealingDeque&) = delete;
+        WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+        /**
+         * @brief Push a value at the bottom of the deque. Owner thread only.
+         */
+        void Push(T value)
+        {
+            const int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+            const int64_t top = m_top.load(std::memory_order_acquire);
+            Buffer* buffer = m_buffer.load(std::memory_order_relaxed);
+
+            if (bottom - top > buffer->capacity - 1) [[unlikely]]
+                buffer = Grow(buffer, bottom, top);
+
+            buffer->Put(bottom, value);
+            m_bottom.store(bottom + 1, std::memory_order_release);
+        }
+
+        /**
+         * @brief Pop the most recently pushed value. Owner thread only.
+         * @return The popped value, std::nullopt if deque is empty.
+         */
+        std::optional<T> Pop()
+        {
+            const int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+            Buffer* buffer = m_buffer.load(std::memory_order_relaxed);
+            m_bottom.store(bottom, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t top = m_top.load(std::memory_order_relaxed);
+
+            if (top > bottom)
+            {
+                // Deque was empty, restore bottom.
+                m_bottom.store(bottom + 1, std::memory_order_relaxed);
+                return std::nullopt;
+            }
+
+            T value = buffer->Get(bottom);
+            if (top == bottom)
+            {
+                // Last element, race against thieves for it.
+                const bool won = m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+                m_bottom.store(bottom + 1, std::memory_order_relaxed);
+                if (!won)
+                    return std::nullopt;
+            }
+
+            return value;
+        }
+
+        /**
+         * @brief Steal the oldest value from the deque. Safe to call from any thread.
+         * @return The stolen value, std::nullopt if deque is empty.
+         */
+        std::optional<T> Steal()
+        {
+            for (;;)
+            {
+                int64_t top = m_top.load(std::memory_order_acquire);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                const int64_t bottom = m_bottom.load(std::memory_order_acquire);
+
+                if (top >= bottom)
+                    return std::nullopt;
+
+                Buffer* buffer = m_buffer.load(std::memory_order_acquire);
+                T value = buffer->Get(top);
+                if (m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                    return value;
+
+                // Lost the race against an other thief or the owner, retry
+                // as long as there is anything left to take.
+            }
+        }
+
+        /**
+         * @brief Get an approximation of the number of values in the deque.
+         */
+        [[nodiscard]] size_t Size() const
+        {
+            const int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+            const int64_t top = m_top.load(std::memory_order_relaxed);
+            return bottom > top ? static_cast<size_t>(bottom - top) : 0;
+        }
+
+        [[nodiscard]] bool IsEmpty() const
+        {
+            return Size() == 0;
+        }
+
+    private:
+        struct Buffer
+        {
+            int64_t capacity;
+            int64_t mask;
+            std::unique_ptr<std::atomic<T>[]> data;
+
+            explicit Buffer(size_t capacity_) :
+                capacity(static_cast<int64_t>(capacity_)),
+                mask(static_cast<int64_t>(capacity_) - 1),
+                data(std::make_unique<std::atomic<T>[]>(capacity_))
+            {
+            }
+
+            void Put(int64_t index, T value) noexcept
+            {
+                data[index & mask].store(value, std::memory_order_relaxed);
+            }
+
+            [[nodiscard]] T Get(int64_t index) const noexcept
+            {
+                return data[index & mask].load(std::memory_order_relaxed);
+            }
+        };
+
+        Buffer* Grow(Buffer* buffer, int64_t bottom, int64_t top)
+        {
+            auto newBuffer = std::make_unique<Buffer>(static_cast<size_t>(buffer->capacity) * 2);
+            for (int64_t i = top; i < bottom; ++i)
+                newBuffer->Put(i, buffer->Get(i));
+
+            Buffer* result = newBuffer.get();
+            m_garbage.emplace_back(std::move(newBuffer));
+            m_buffer.store(result, std::memory_order_release);
+            return result;
+        }
+
+        alignas(std::hardware_destructive_interference_size) std::atomic<int64_t> m_top{ 0 };
+        alignas(std::hardware_destructive_interference_size) std::atomic<int64_t> m_bottom{ 0 };
+        alignas(std::hardware_destructive_interference_size) std::atomic<Buffer*> m_buffer{ nullptr };
+        std::vector<std::unique_ptr<Buffer>> m_garbage;     // owner only
+    };
+} // namespace cyb
@@ -1,4 +1,6 @@
 #define IMGUI_DEFINE_MATH_OPERATORS
+#include <atomic>
+#include <memory>
 #include <numeric>
 #include <format>
 #include <functional>
@@ -13,6 +15,7 @@
 #include "graphics/renderer.h"
 #include "graphics/model_import.h"
 #include "systems/event_system.h"
+#include "systems/job_system.h"
 #include "systems/profiler.h"
 #include "editor/editor.h"
 #include "editor/filedialog.h"
@@ -241,7 +244,7 @@ namespace cyb::editor
         {
             ecs::Entity selectedID = SelectEntityPopup(scene.materials, scene.names, mesh.subsets[selectedSubsetIndex].materialID);
             if (selectedID != ecs::INVALID_ENTITY)
-                mesh.subsets[selectedSubsetIndex].materialID = selectedID;
+                scene.SetSubsetMaterial(mesh.subsets[selectedSubsetIndex], selectedID);
 
             ImGui::EndPopup();
         }
@@ -267,7 +270,7 @@ namespace cyb::editor
             ecs::Entity selectedID = SelectEntityPopup(scene.meshes, scene.names, object.meshID);
             if (selectedID != ecs::INVALID_ENTITY)
             {
-                object.meshID = selectedID;
+                scene.SetObjectMesh(object, selectedID);
             }
             ImGui::EndPopup();
         }
@@ -403,14 +406,10 @@ namespace cyb::editor
         m_entities.insert(entity);
 
         // Generate a list of all child nodes
-        for (size_t i = 0; i < scene.hierarchy.Size(); ++i)
+        for (ecs::Entity child_entity = scene.GetFirstChild(entity); child_entity != ecs::INVALID_ENTITY; child_entity = scene.GetNextSibling(child_entity))
         {
-            if (scene.hierarchy[i].parentID == entity)
-            {
-                const ecs::Entity child_entity = scene.hierarchy.GetEntity(i);
-                const std::string_view child_name = scene.names.GetComponent(child_entity)->name;
-                AddNode(&parent->children.back(), child_entity, child_name);
-            }
+            const std::string_view child_name = scene.names.GetComponent(child_entity)->name;
+            AddNode(&parent->children.back(), child_entity, child_name);
         }
     }
 
@@ -645,27 +644,52 @@ namespace cyb::editor
         return entity;
     }
 
+    // Scene loads are tracked in a single context so they can be awaited on
+    // shutdown. Each load takes a new generation, and a load that has been
+    // superseded by a newer one is dropped instead of replacing the scene.
+    static jobsystem::Context loadSceneContext;
+    static std::atomic<uint32_t> loadSceneGeneration{ 0 };
+
+    // Reads and deserializes a scene on a background thread, then replaces
+    // the current scene with it on the next thread safe point.
+    static jobsystem::AsyncTask LoadSceneAsync(std::string filename, uint32_t generation)
+    {
+        co_await jobsystem::SwitchTo(jobsystem::Priority::Background);
+
+        Timer timer;
+        auto newScene = std::make_shared<scene::Scene>();
+        if (!SerializeFromFile(filename, *newScene))
+        {
+            CYB_ERROR("Failed to serialize file: {}", filename);
+            co_return;
+        }
+
+        if (generation != loadSceneGeneration.load())
+        {
+            CYB_INFO("Discarded superseded scene load (filename={})", filename);
+            co_return;
+        }
+
+        eventsystem::Subscribe_Once(eventsystem::Event_ThreadSafePoint, [=](uint64_t) {
+            // A newer load may have started after this one was scheduled
+            if (generation != loadSceneGeneration.load())
+                return;
+
+            scene::Scene& scene = scene::GetScene();
+            scene.Clear();
+            scene.Merge(*newScene);
+            CYB_INFO("Serialized scene from file (filename={0}) in {1:.2f}ms", filename, timer.ElapsedMilliseconds());
+        });
+    }
+
     // Clears the current scene and loads in a new from a selected file.
     // TODO: Add a dialog to prompt user about unsaved progress
     void OpenDialog_Open()
     {
         const std::vector<FileDialogFilter> filters = { FILE_FILTER_SCD, FILE_FILTER_ALL };
         OpenLoadFileDialogAsync(filters, [](const std::string& filename) {
-            eventsystem::Subscribe_Once(eventsystem::Event_ThreadSafePoint, [=](uint64_t) {
-                Timer timer;
-
-                scene::Scene newScene;
-                if (!SerializeFromFile(filename, newScene))
-                {
-                    CYB_ERROR("Failed to serialize file: {}", filename);
-                    return;
-                }
-
-                scene::Scene& scene = scene::GetScene();
-                scene.Clear();
-                scene.Merge(newScene);
-                CYB_INFO("Serialized scene from file (filename={0}) in {1:.2f}ms", filename, timer.ElapsedMilliseconds());
-            });
+            const uint32_t generation = ++loadSceneGeneration;
+            jobsystem::Spawn(loadSceneContext, LoadSceneAsync(filename, generation));
         });
     }
 
@@ -717,11 +741,9 @@ namespace cyb::editor
 
     static void DeleteSelectedEntity()
     {
-        eventsystem::Subscribe_Once(eventsystem::Event_ThreadSafePoint, [=] (uint64_t) {
-            scene::GetScene().RemoveEntity(
-                scenegraphView.GetSelectedEntity(),
-                e_recursiveDelete.GetValue(),
-                e_autoremoveLinkedEntities.GetValue());
+        scene::Scene& scene = scene::GetScene();
+        scene.commands.Record()->Defer([&scene, entity = scenegraphView.GetSelectedEntity()] {
+            scene.RemoveEntity(entity, e_recursiveDelete.GetValue(), e_autoremoveLinkedEntities.GetValue());
         });
     }
 
@@ -794,6 +816,51 @@ namespace cyb::editor
             ImGui::Unindent();
             ImGui::PopStyleVar();
             ImGui::EndTable();
+
+            if (ImGui::CollapsingHeader("Job System"))
+                DrawJobStatistics(profilerContext.jobStatistics);
+        }
+
+    private:
+        // Per thread jobsystem activity during the last frame.
+        void DrawJobStatistics(const jobsystem::Statistics& stats)
+        {
+            ImGui::Text("Shared queue submits: %llu", (unsigned long long)stats.sharedQueueSubmits);
+            if (!ImGui::BeginTable("Job System Threads", 6, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg))
+                return;
+
+            ImGui::TableSetupColumn("Thread");
+            ImGui::TableSetupColumn("Busy");
+            ImGui::TableSetupColumn("Jobs");
+            ImGui::TableSetupColumn("Stolen");
+            ImGui::TableSetupColumn("Wakes");
+            ImGui::TableSetupColumn("Wake latency");
+            ImGui::TableHeadersRow();
+
+            const size_t workerCount = jobsystem::GetThreadCount();
+            for (size_t i = 0; i < stats.threads.size(); ++i)
+            {
+                const jobsystem::ThreadStatistics& thread = stats.threads[i];
+                const std::string name = i < workerCount ? std::format("Worker {}", i) :
+                    i == workerCount ? std::string("Main") : std::format("Background {}", i - workerCount - 1);
+                const double totalTime = thread.busyTime + thread.idleTime;
+
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn();
+                ImGui::TextUnformatted(name.c_str());
+                ImGui::TableNextColumn();
+                ImGui::Text("%.0f%%", totalTime > 0.0 ? 100.0 * thread.busyTime / totalTime : 0.0);
+                ImGui::TableNextColumn();
+                ImGui::Text("%llu", (unsigned long long)thread.jobsExecuted);
+                ImGui::TableNextColumn();
+                ImGui::Text("%llu", (unsigned long long)thread.jobsStolen);
+                ImGui::TableNextColumn();
+                ImGui::Text("%llu", (unsigned long long)thread.wakeCount);
+                ImGui::TableNextColumn();
+                ImGui::Text("%.1fus", thread.wakeCount > 0 ? thread.wakeLatency * 1000.0 / thread.wakeCount : 0.0);
+            }
+
+            ImGui::EndTable();
         }
     };
 
@@ -1429,12 +1496,13 @@ namespace cyb::editor
         scene::CameraComponent& camera = scene::GetCamera();
 
         const ecs::Entity entity = scenegraphView.GetSelectedEntity();
-        scene::TransformComponent* transform = scene.transforms.GetComponent(entity);
-        if (!transform)
+        const size_t transformIndex = scene.transforms.GetIndex(entity);
+        if (transformIndex == std::numeric_limits<size_t>::max())
             return;
+        scene::TransformComponent* transform = &scene.transforms[transformIndex];
 
         XMFLOAT4X4 world{};
-        XMStoreFloat4x4(&world, transform->world);
+        XMStoreFloat4x4(&world, scene.GetWorldMatrix(transformIndex));
 
         ImGuizmo::SetRect(0, 0, io.DisplaySize.x, io.DisplaySize.y);
         ImGuizmo::Manipulate(
@@ -1471,9 +1539,9 @@ namespace cyb::editor
             const scene::HierarchyComponent* hierarchy = scene.hierarchy.GetComponent(entity);
             if (hierarchy)
             {
-                const scene::TransformComponent* parent_transform = scene.transforms.GetComponent(hierarchy->parentID);
-                if (parent_transform != nullptr)
-                    transform->MatrixTransform(XMMatrixInverse(nullptr, parent_transform->world));
+                const size_t parentIndex = scene.transforms.GetIndex(hierarchy->parentID);
+                if (parentIndex != std::numeric_limits<size_t>::max())
+                    transform->MatrixTransform(XMMatrixInverse(nullptr, scene.GetWorldMatrix(parentIndex)));
             }
 
             isUsingGizmo = true;
@@ -1541,6 +1609,13 @@ namespace cyb::editor
         initialized = true;
     }
 
+    void Shutdown()
+    {
+        // Invalidate any pending scene load and wait for it to finish
+        ++loadSceneGeneration;
+        jobsystem::Wait(loadSceneContext);
+    }
+
     static void UpdateFPSCounter(double dt)
     {
         deltatimes[fpsAgvCounter++ % deltatimes.size()] = dt;
@@ -64,6 +64,8 @@ namespace cyb::editor
     };
 
     void Initialize();
+    // Wait for pending editor jobs, must be called before the jobsystem is shut down
+    void Shutdown();
     void Update(bool showGui, double dt);
 
     // Check whether the editor wants the input (key or mouse)
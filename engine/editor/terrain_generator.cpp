@@ -15,7 +15,6 @@
 #include "imgui_internal.h"
 
 #define MULTITHREADED_PREVIEW   1
-#define PREVIEW_GEN_GROUP_SIZE  32          // rows per thread group when multithreading
 
 namespace cyb::editor
 {
@@ -315,8 +314,7 @@ namespace cyb::editor
         noise2::NoiseImage image{ { m_previewSize, m_previewSize } };
 #if MULTITHREADED_PREVIEW
         jobsystem::Context ctx{};
-        const uint32_t groupSize = PREVIEW_GEN_GROUP_SIZE;
-        jobsystem::Dispatch(ctx, imageDesc.size.height, groupSize, [&] (jobsystem::JobArgs args) {
+        jobsystem::ParallelFor(ctx, imageDesc.size.height, [&] (jobsystem::JobArgs args) {
             const uint32_t rowStart = args.jobIndex;
             noise2::RenderNoiseImageRows(image, &imageDesc, rowStart, 1);
         });
@@ -611,7 +609,7 @@ namespace cyb::editor
             const XMFLOAT3 offsetToCenter = XMFLOAT3(-(m_chunkSize * 0.5f), 0.0f, -(m_chunkSize * 0.5f));
             mesh->vertex_positions.resize(points.size());
             mesh->vertex_colors.resize(points.size());
-            jobsystem::Dispatch(ctx, (uint32_t)points.size(), 512, [&] (jobsystem::JobArgs args) {
+            jobsystem::ParallelFor(ctx, (uint32_t)points.size(), [&] (jobsystem::JobArgs args) {
                 const uint32_t index = args.jobIndex;
                 mesh->vertex_positions[index] = XMFLOAT3(
                     offsetToCenter.x + points[index].x * m_chunkSize,
@@ -622,7 +620,7 @@ namespace cyb::editor
 
             // load mesh indexes
             mesh->indices.resize(triangles.size() * 3);
-            jobsystem::Dispatch(ctx, (uint32_t)triangles.size(), 512, [&] (jobsystem::JobArgs args) {
+            jobsystem::ParallelFor(ctx, (uint32_t)triangles.size(), [&] (jobsystem::JobArgs args) {
                 const uint32_t index = args.jobIndex;
                 mesh->indices[(index * 3) + 0] = triangles[index].x;
                 mesh->indices[(index * 3) + 1] = triangles[index].z;
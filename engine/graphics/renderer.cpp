@@ -5,6 +5,7 @@
 #include "systems/scene.h"
 #include "systems/event_system.h"
 #include "systems/profiler.h"
+#include "systems/parallel_algorithms.h"
 #include "graphics/renderer.h"
 #include "graphics/image.h"
 #include "graphics/shader_compiler.h"
@@ -443,20 +444,14 @@ namespace cyb::renderer
             CYB_PROFILE_CPU_SCOPE("Frustum Culling");
             const Frustum& cameraFrustum = camera->frustum;
 
-            // perform camera frustum culling to all objects aabb and
-            // store all visible objects in the view
-            objectIndexes.resize(scene->objects.Size());
-            for (size_t objectIndex = 0; objectIndex < scene->objects.Size(); ++objectIndex)
-            {
-                const AxisAlignedBox& aabb = scene->aabb_objects[objectIndex];
+            // perform camera frustum culling to all objects using the scene
+            // bvh and store all visible, renderable objects in the view
+            scene->QueryObjects(cameraFrustum, objectIndexes);
+            std::erase_if(objectIndexes, [&] (uint32_t objectIndex) {
                 const scene::ObjectComponent& object = scene->objects[objectIndex];
-                if (HasFlag(object.flags, scene::ObjectComponent::Flags::RenderableBit) &&
-                    cameraFrustum.IntersectsBoundingBox(aabb))
-                {
-                    objectIndexes[objectCount] = static_cast<uint32_t>(objectIndex);
-                    ++objectCount;
-                }
-            }
+                return !HasFlag(object.flags, scene::ObjectComponent::Flags::RenderableBit);
+            });
+            objectCount = (uint32_t)objectIndexes.size();
 
             // perform basic camera frustum calling to all light sources
             // all directional lights will be added
@@ -471,14 +466,31 @@ namespace cyb::renderer
                 if (cameraFrustum.IntersectsBoundingBox(aabb) ||
                     light.GetType() == LightType::Directional)
                 {
-                    lightIndexes[lightCount] = lightIndex;
+                    lightIndexes[lightCount] = (uint32_t)lightIndex;
                     ++lightCount;
                 }
             }
 
-            objectIndexes.resize(objectCount);
             lightIndexes.resize(lightCount);
         }
+
+        {
+            CYB_PROFILE_CPU_SCOPE("Sort Draw Order");
+
+            // sort visible objects by stencil ref and mesh to minimize state
+            // changes in DrawScene, the object index is kept in the low bits
+            drawKeys.resize(objectCount);
+            for (uint32_t i = 0; i < objectCount; ++i)
+            {
+                const scene::ObjectComponent& object = scene->objects[objectIndexes[i]];
+                const uint64_t sortKey = ((uint64_t)object.userStencilRef << 24) | (object.meshIndex & 0xFFFFFF);
+                drawKeys[i] = (sortKey << 32) | objectIndexes[i];
+            }
+
+            jobsystem::ParallelSort(std::span(drawKeys));
+            for (uint32_t i = 0; i < objectCount; ++i)
+                objectIndexes[i] = (uint32_t)drawKeys[i];
+        }
     }
 
     void UpdatePerFrameData(const SceneView& view, float time, FrameConstants& frameCB)
@@ -563,6 +575,7 @@ namespace cyb::renderer
 
         uint8_t prevUserStencilRef = 0;
         device->BindStencilRef(0, cmd);
+        const MeshComponent* prevMesh = nullptr;
 
         // Draw all visible objects
         for (uint32_t objectIndex : view.objectIndexes)
@@ -575,30 +588,34 @@ namespace cyb::renderer
                 device->BindStencilRef(object.userStencilRef, cmd);
             }
 
+            // objects are sorted by mesh, so buffers are only bound once per mesh
             const MeshComponent& mesh = view.scene->meshes[object.meshIndex];
-            if (mesh.vertex_buffer_col.IsValid())
-            {
-                std::array<const rhi::GPUBuffer*, 2> vertex_buffers = {
-                    &mesh.vertex_buffer_pos,
-                    &mesh.vertex_buffer_col
-                };
-
-                std::array<uint32_t, 2> strides = {
-                    sizeof(scene::MeshComponent::Vertex_Pos),
-                    sizeof(scene::MeshComponent::Vertex_Col)
-                };
-
-                device->BindVertexBuffers(vertex_buffers.data(), vertex_buffers.size(), strides.data(), nullptr, cmd);
-                device->BindIndexBuffer(&mesh.index_buffer, IndexBufferFormat::Uint32, 0, cmd);
-            }
-            else
+            if (&mesh != prevMesh)
             {
-                //device->BindVertexBuffer(&mesh->vertex_buffer_pos);
+                prevMesh = &mesh;
+                if (mesh.vertex_buffer_col.IsValid())
+                {
+                    std::array<const rhi::GPUBuffer*, 2> vertex_buffers = {
+                        &mesh.vertex_buffer_pos,
+                        &mesh.vertex_buffer_col
+                    };
+
+                    std::array<uint32_t, 2> strides = {
+                        sizeof(scene::MeshComponent::Vertex_Pos),
+                        sizeof(scene::MeshComponent::Vertex_Col)
+                    };
+
+                    device->BindVertexBuffers(vertex_buffers.data(), vertex_buffers.size(), strides.data(), nullptr, cmd);
+                    device->BindIndexBuffer(&mesh.index_buffer, IndexBufferFormat::Uint32, 0, cmd);
+                }
+                else
+                {
+                    //device->BindVertexBuffer(&mesh->vertex_buffer_pos);
+                }
             }
 
-            const TransformComponent& transform = view.scene->transforms[object.transformIndex];
             MiscCB cb = {};
-            XMMATRIX W = transform.world;
+            const XMMATRIX W = view.scene->GetWorldMatrix(object.transformIndex);
             XMStoreFloat4x4(&cb.g_xModelMatrix, XMMatrixTranspose(W));
             XMStoreFloat4x4(&cb.g_xTransform, XMMatrixTranspose(W * view.camera->VP));
             device->BindDynamicConstantBuffer(cb, CBSLOT_MISC, cmd);
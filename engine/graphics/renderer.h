@@ -105,8 +105,9 @@ namespace cyb::renderer
 
         uint32_t objectCount = 0;
         uint32_t lightCount = 0;
-        std::vector<uint32_t> objectIndexes;   // scene->objects indexes
+        std::vector<uint32_t> objectIndexes;   // scene->objects indexes, sorted in draw order
         std::vector<uint32_t> lightIndexes;    // scene->lights indexes
+        std::vector<uint64_t> drawKeys;        // scratch buffer for sorting objects
     };
 
     const rhi::Shader* GetShader(SHADERTYPE id);
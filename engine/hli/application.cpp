@@ -11,6 +11,7 @@
 #include "hli/application.h"
 #include "config.h"
 
+#include "editor/editor.h"
 #include "editor/imgui_backend.h"
 #include "editor/filedialog.h"
 
@@ -113,6 +114,12 @@ namespace cyb::hli
             profiler::EndFrame(cmd);
             m_graphicsDevice->ExecuteCommandLists();
         } while (true);
+
+        // Pending work must be finished before the worker threads are stopped
+#ifndef NO_EDITOR
+        editor::Shutdown();
+#endif
+        jobsystem::Shutdown();
     }
 
     void Application::Update(double dt)
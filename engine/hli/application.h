@@ -19,7 +19,8 @@ namespace cyb::hli
 
         /** 
          * Starts the main update loop. Loop will exit when the client window
-         * is closed or the application is requested to exit.
+         * is closed or the application is requested to exit, after which
+         * pending jobs are awaited and the jobsystem is shut down.
          */
         void UpdateLoop();
 
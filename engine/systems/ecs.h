@@ -1,18 +1,149 @@
 #pragma once
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <cassert>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #include "core/serializer.h"
+#include "core/spinlock.h"
 #include "systems/job_system.h"
-#include "flat_hash_map.hpp"
 
 namespace cyb::ecs
 {
+    /**
+     * Entities are 32-bit handles packing a slot index in the low bits and a
+     * generation in the high bits. Destroyed entity indexes are recycled with
+     * an incremented generation, so handles to destroyed entities (stale
+     * handles) can be detected, while the index range stays compact.
+     */
     using Entity = uint32_t;
     static constexpr Entity INVALID_ENTITY = 0;
+    static constexpr uint32_t ENTITY_INDEX_BITS = 24;
+    static constexpr uint32_t ENTITY_GENERATION_BITS = 32 - ENTITY_INDEX_BITS;
+    static constexpr uint32_t ENTITY_INDEX_MASK = (1u << ENTITY_INDEX_BITS) - 1;
+    static constexpr uint32_t ENTITY_GENERATION_MASK = (1u << ENTITY_GENERATION_BITS) - 1;
 
-    inline Entity CreateEntity()
+    [[nodiscard]] constexpr uint32_t GetEntityIndex(Entity entity)
     {
-        static std::atomic<Entity> next = INVALID_ENTITY + 1;
-        return next.fetch_add(1);
+        return entity & ENTITY_INDEX_MASK;
+    }
+
+    [[nodiscard]] constexpr uint32_t GetEntityGeneration(Entity entity)
+    {
+        return (entity >> ENTITY_INDEX_BITS) & ENTITY_GENERATION_MASK;
+    }
+
+    [[nodiscard]] constexpr Entity MakeEntity(uint32_t index, uint32_t generation)
+    {
+        return ((generation & ENTITY_GENERATION_MASK) << ENTITY_INDEX_BITS) | (index & ENTITY_INDEX_MASK);
+    }
+
+    namespace detail
+    {
+        static_assert(ENTITY_GENERATION_BITS <= 8, "EntityAllocator stores generations as uint8_t");
+
+        /**
+         * @brief Thread-safe entity allocator, recycling destroyed indexes.
+         *
+         * Index 0 is never used, keeping INVALID_ENTITY distinct from all
+         * valid handles. Freed indexes are reused in FIFO order, and only
+         * once enough of them have been queued, so a generation takes a long
+         * time to wrap around for any given index.
+         */
+        class EntityAllocator
+        {
+        public:
+            static constexpr uint32_t MIN_FREE_INDEXES = 1024;
+
+            [[nodiscard]] Entity Create()
+            {
+                std::scoped_lock lock(m_lock);
+                uint32_t index;
+                if (m_freeIndexes.size() > MIN_FREE_INDEXES)
+                {
+                    index = m_freeIndexes.front();
+                    m_freeIndexes.pop_front();
+                }
+                else
+                {
+                    if (m_generations.empty())
+                        m_generations.push_back(0);     // reserve index 0 for INVALID_ENTITY
+                    index = (uint32_t)m_generations.size();
+                    assert(index <= ENTITY_INDEX_MASK);
+                    m_generations.push_back(0);
+                }
+
+                return MakeEntity(index, m_generations[index]);
+            }
+
+            // Destroying a stale or invalid entity is a no-op.
+            void Destroy(Entity entity)
+            {
+                std::scoped_lock lock(m_lock);
+                if (!IsAliveLocked(entity))
+                    return;
+
+                const uint32_t index = GetEntityIndex(entity);
+                m_generations[index] = (m_generations[index] + 1) & ENTITY_GENERATION_MASK;
+                m_freeIndexes.push_back(index);
+            }
+
+            [[nodiscard]] bool IsAlive(Entity entity)
+            {
+                std::scoped_lock lock(m_lock);
+                return IsAliveLocked(entity);
+            }
+
+        private:
+            [[nodiscard]] bool IsAliveLocked(Entity entity) const
+            {
+                const uint32_t index = GetEntityIndex(entity);
+                return index != 0 && index < m_generations.size() && m_generations[index] == GetEntityGeneration(entity);
+            }
+
+            SpinLock m_lock;
+            std::vector<uint8_t> m_generations;
+            std::deque<uint32_t> m_freeIndexes;
+        };
+
+        inline EntityAllocator& GetEntityAllocator()
+        {
+            static EntityAllocator allocator;
+            return allocator;
+        }
+    } // namespace detail
+
+    [[nodiscard]] inline Entity CreateEntity()
+    {
+        return detail::GetEntityAllocator().Create();
+    }
+
+    /**
+     * @brief Release an entity handle, allowing it's index to be reused.
+     *        Components are not removed, that's up to the owning scene.
+     */
+    inline void DestroyEntity(Entity entity)
+    {
+        detail::GetEntityAllocator().Destroy(entity);
+    }
+
+    /**
+     * @brief Check if entity is a handle to a created, not yet destroyed, entity.
+     */
+    [[nodiscard]] inline bool IsEntityAlive(Entity entity)
+    {
+        return detail::GetEntityAllocator().IsAlive(entity);
     }
 
     struct SceneSerializeContext
@@ -50,6 +181,63 @@ namespace cyb::ecs
         }
     }
 
+    /**
+     * @brief Paged sparse array mapping entity indexes to dense component indexes.
+     *
+     * Entity indexes are recycled and kept compact, so a sparse array gives
+     * O(1) lookups without any hashing. The array is split into fixed size
+     * pages allocated on first use, so unused index ranges costs no memory.
+     * Only the index part of the handle is used, callers are responsible
+     * for checking the generation.
+     */
+    class SparseEntityIndex
+    {
+    public:
+        static constexpr uint32_t INVALID_INDEX = ~0u;
+        static constexpr uint32_t PAGE_SIZE = 4096;
+
+        [[nodiscard]] uint32_t Find(Entity entity) const
+        {
+            const uint32_t slot = GetEntityIndex(entity);
+            const size_t page = slot / PAGE_SIZE;
+            if (page >= m_pages.size() || m_pages[page] == nullptr)
+                return INVALID_INDEX;
+            return m_pages[page][slot % PAGE_SIZE];
+        }
+
+        void Insert(Entity entity, uint32_t index)
+        {
+            const uint32_t slot = GetEntityIndex(entity);
+            const size_t page = slot / PAGE_SIZE;
+            if (page >= m_pages.size())
+                m_pages.resize(page + 1);
+
+            if (m_pages[page] == nullptr)
+            {
+                m_pages[page] = std::make_unique_for_overwrite<uint32_t[]>(PAGE_SIZE);
+                std::fill_n(m_pages[page].get(), PAGE_SIZE, INVALID_INDEX);
+            }
+
+            m_pages[page][slot % PAGE_SIZE] = index;
+        }
+
+        void Erase(Entity entity)
+        {
+            const uint32_t slot = GetEntityIndex(entity);
+            const size_t page = slot / PAGE_SIZE;
+            if (page < m_pages.size() && m_pages[page] != nullptr)
+                m_pages[page][slot % PAGE_SIZE] = INVALID_INDEX;
+        }
+
+        void Clear()
+        {
+            m_pages.clear();
+        }
+
+    private:
+        std::vector<std::unique_ptr<uint32_t[]>> m_pages;
+    };
+
     template <typename T>
     class ComponentManager
     {
@@ -58,38 +246,54 @@ namespace cyb::ecs
         {
             m_components.reserve(reservedCount);
             m_entities.reserve(reservedCount);
-            m_lookup.reserve(reservedCount);
         }
 
         ComponentManager(const ComponentManager&) = delete;
         ComponentManager& operator=(const ComponentManager&) = delete;
 
+        // reserve memory for a total of count components
+        void Reserve(size_t count)
+        {
+            m_components.reserve(count);
+            m_entities.reserve(count);
+        }
+
         // clear the container of all components and entities
         inline void Clear()
         {
             m_components.clear();
             m_entities.clear();
-            m_lookup.clear();
+            m_lookup.Clear();
+            ++m_version;
         }
 
         // merge in an other component manager of the same type to this. 
         // the other component manager MUST NOT contain any of the same entities!
         // the other component manager is not retained after this operation!
+        // components are moved, and if this is empty the storage is just stolen.
         void Merge(ComponentManager<T>& other)
         {
-            m_components.reserve(Size() + other.Size());
-            m_entities.reserve(Size() + other.Size());
-            m_lookup.reserve(Size() + other.Size());
-
-            for (size_t i = 0; i < other.Size(); ++i)
+            if (m_components.empty())
             {
-                Entity entity = other.m_entities[i];
-                assert(!Contains(entity));
-                m_entities.push_back(entity);
-                m_lookup[entity] = m_components.size();
-                m_components.push_back(other.m_components[i]);
+                m_components = std::move(other.m_components);
+                m_entities = std::move(other.m_entities);
+                m_lookup = std::move(other.m_lookup);
             }
+            else
+            {
+                const size_t offset = m_components.size();
+                assert(offset + other.Size() < SparseEntityIndex::INVALID_INDEX);
+                m_components.insert(m_components.end(), std::make_move_iterator(other.m_components.begin()), std::make_move_iterator(other.m_components.end()));
+                m_entities.insert(m_entities.end(), other.m_entities.begin(), other.m_entities.end());
 
+                for (size_t i = offset; i < m_entities.size(); ++i)
+                {
+                    assert(m_lookup.Find(m_entities[i]) == SparseEntityIndex::INVALID_INDEX);
+                    m_lookup.Insert(m_entities[i], (uint32_t)i);
+                }
+            }
+
+            ++m_version;
             other.Clear();
         }
 
@@ -113,8 +317,11 @@ namespace cyb::ecs
                 SerializeEntity(m_entities[i], ser, entitySerializer);
 
                 if (ser.IsReading())
-                    m_lookup[m_entities[i]] = i;
+                    m_lookup.Insert(m_entities[i], (uint32_t)i);
             }
+
+            if (ser.IsReading())
+                ++m_version;
         }
 
         // ecs::INVALID_ENTITY is not allowed!
@@ -124,61 +331,61 @@ namespace cyb::ecs
         T& Create(Entity entity, Args&&... args)
         {
             assert(entity != INVALID_ENTITY);
-            assert(m_lookup.find(entity) == m_lookup.end());
+            assert(m_lookup.Find(entity) == SparseEntityIndex::INVALID_INDEX);   // also catches stale handles
             assert(m_entities.size() == m_components.size());
-            assert(m_lookup.size() == m_components.size());
+            assert(m_components.size() < SparseEntityIndex::INVALID_INDEX);
 
-            m_lookup[entity] = m_components.size();
+            m_lookup.Insert(entity, (uint32_t)m_components.size());
             m_entities.push_back(entity);
+            ++m_version;
             return m_components.emplace_back(std::forward<Args>(args)...);
         }
 
         void Remove(Entity entity)
         {
-            auto it = m_lookup.find(entity);
-            if (it == m_lookup.end())
+            const uint32_t index = Find(entity);
+            if (index == SparseEntityIndex::INVALID_INDEX)
                 return;
 
-            const size_t index = it->second;
-
             if (index < m_components.size() - 1)
             {
                 std::swap(m_components[index], m_components.back());
                 m_entities[index] = m_entities.back();
-                m_lookup[m_entities[index]] = index;
+                m_lookup.Insert(m_entities[index], index);
             }
 
             // shrink the container
             m_components.pop_back();
             m_entities.pop_back();
-            m_lookup.erase(entity);
+            m_lookup.Erase(entity);
+            ++m_version;
         }
 
         // check if a component exists for a given entity or not
         [[nodiscard]] bool Contains(Entity entity) const
         {
-            return m_lookup.find(entity) != m_lookup.end();
+            return Find(entity) != SparseEntityIndex::INVALID_INDEX;
         }
 
         // retrieve a [read/write] component specified by an entity (if it exists, otherwise nullptr)
         [[nodiscard]] T* GetComponent(Entity entity)
         {
-            auto it = m_lookup.find(entity);
-            return it != m_lookup.end() ? &m_components[it->second] : nullptr;
+            const uint32_t index = Find(entity);
+            return index != SparseEntityIndex::INVALID_INDEX ? &m_components[index] : nullptr;
         }
 
         // retrieve a [read only] component specified by an entity (if it exists, otherwise nullptr)
         [[nodiscard]] const T* GetComponent(Entity entity) const
         {
-            const auto it = m_lookup.find(entity);
-            return it != m_lookup.end() ? &m_components[it->second] : nullptr;
+            const uint32_t index = Find(entity);
+            return index != SparseEntityIndex::INVALID_INDEX ? &m_components[index] : nullptr;
         }
 
         // retrieve component index by entity handle (if not found, returns std::numeric_limits<size_t>::max)
         [[nodiscard]] size_t GetIndex(Entity entity) const
         {
-            const auto it = m_lookup.find(entity);
-            return it != m_lookup.end() ? it->second : std::numeric_limits<size_t>::max();
+            const uint32_t index = Find(entity);
+            return index != SparseEntityIndex::INVALID_INDEX ? index : std::numeric_limits<size_t>::max();
         }
 
         [[nodiscard]] Entity GetEntity(size_t index) const
@@ -186,6 +393,9 @@ namespace cyb::ecs
             return m_entities[index];
         }
 
+        // incremented whenever components are added, removed or moved
+        [[nodiscard]] uint64_t GetVersion() const { return m_version; }
+
         [[nodiscard]] size_t Size() const { return m_components.size(); }
         [[nodiscard]] T& operator[](size_t index) { return m_components[index]; }
         [[nodiscard]] const T& operator[](size_t index) const { return m_components[index]; }
@@ -195,8 +405,457 @@ namespace cyb::ecs
         [[nodiscard]] auto end() const noexcept { return m_components.end(); }
 
     private:
+        // Lookup the component index, rejecting stale handles sharing the index of a live entity.
+        [[nodiscard]] uint32_t Find(Entity entity) const
+        {
+            const uint32_t index = m_lookup.Find(entity);
+            return index != SparseEntityIndex::INVALID_INDEX && m_entities[index] == entity ? index : SparseEntityIndex::INVALID_INDEX;
+        }
+
         std::vector<T> m_components;
         std::vector<Entity> m_entities;
-        ska::flat_hash_map<Entity, size_t> m_lookup;
+        SparseEntityIndex m_lookup;
+        uint64_t m_version{ 0 };
+    };
+
+    namespace detail
+    {
+        // Position of T in the parameter pack Ts.
+        template <typename T, typename... Ts>
+        constexpr size_t TypeIndex()
+        {
+            constexpr bool matches[] = { std::is_same_v<T, Ts>... };
+            for (size_t i = 0; i < sizeof...(Ts); ++i)
+            {
+                if (matches[i])
+                    return i;
+            }
+            return sizeof...(Ts);
+        }
+    } // namespace detail
+
+    /**
+     * @brief Join of component managers, iterating all entities having every
+     *        one of the component types.
+     *
+     * The join is resolved by walking the smallest manager and looking up the
+     * others, storing the component indexes of each matching entity. Systems
+     * then iterate the stored indexes without any per-entity lookups. The
+     * mapping is only rebuilt by Update() once any of the managers changed.
+     *
+     * Example usage:
+     * View<ObjectComponent, TransformComponent> view(objects, transforms);
+     * view.Update();
+     * view.Each([] (const auto& entry, ObjectComponent& object, TransformComponent& transform) { ... });
+     */
+    template <typename... Ts>
+    class View
+    {
+    public:
+        static_assert(sizeof...(Ts) > 0, "View must have at least one component type");
+        static constexpr size_t COMPONENT_COUNT = sizeof...(Ts);
+
+        struct Entry
+        {
+            Entity entity;
+            std::array<uint32_t, COMPONENT_COUNT> indexes;  // component index in each manager
+
+            template <typename T>
+            [[nodiscard]] uint32_t Index() const
+            {
+                constexpr size_t i = detail::TypeIndex<T, Ts...>();
+                static_assert(i < COMPONENT_COUNT, "T is not a component type of the view");
+                return indexes[i];
+            }
+        };
+
+        explicit View(ComponentManager<Ts>&... managers) :
+            m_managers(&managers...)
+        {
+        }
+
+        View(const View&) = delete;
+        View& operator=(const View&) = delete;
+
+        /**
+         * @brief Rebuild the index mapping if any of the managers have changed.
+         *        Must not be called concurrently with changes to the managers.
+         * @return True if the mapping was rebuilt, invalidating any data
+         *         cached per component index since the last update.
+         */
+        bool Update()
+        {
+            return UpdateImpl(std::index_sequence_for<Ts...>());
+        }
+
+        [[nodiscard]] size_t Size() const { return m_entries.size(); }
+        [[nodiscard]] const Entry& operator[](size_t index) const { return m_entries[index]; }
+        [[nodiscard]] auto begin() const noexcept { return m_entries.begin(); }
+        [[nodiscard]] auto end() const noexcept { return m_entries.end(); }
+
+        // Invoke func(entry, components...) for each entity in the view.
+        template <typename F>
+        void Each(F&& func)
+        {
+            for (const Entry& entry : m_entries)
+                Invoke(func, entry, std::index_sequence_for<Ts...>());
+        }
+
+        /**
+         * @brief Invoke func(entry, components...) for each entity in the view,
+         *        split into chunks executed by the jobsystem.
+         *
+         * The view and managers must be kept alive and unchanged until ctx is finished.
+         */
+        template <typename F>
+        void ParallelEach(jobsystem::Context& ctx, F&& func)
+        {
+            jobsystem::ParallelFor(ctx, (uint32_t)m_entries.size(), [this, func = std::forward<F>(func)] (jobsystem::JobArgs args) {
+                Invoke(func, m_entries[args.jobIndex], std::index_sequence_for<Ts...>());
+            });
+        }
+
+    private:
+        template <size_t... Is>
+        bool UpdateImpl(std::index_sequence<Is...>)
+        {
+            // Managers starts out empty at version 0, matching an empty view.
+            const std::array<uint64_t, COMPONENT_COUNT> versions = { std::get<Is>(m_managers)->GetVersion()... };
+            if (versions == m_versions)
+                return false;
+
+            m_versions = versions;
+            m_entries.clear();
+
+            // Walk the manager with the fewest components.
+            const std::array<size_t, COMPONENT_COUNT> sizes = { std::get<Is>(m_managers)->Size()... };
+            const size_t smallest = (size_t)(std::min_element(sizes.begin(), sizes.end()) - sizes.begin());
+
+            for (size_t i = 0; i < sizes[smallest]; ++i)
+            {
+                Entity entity = INVALID_ENTITY;
+                ((Is == smallest ? (entity = std::get<Is>(m_managers)->GetEntity(i), true) : false) || ...);
+
+                Entry entry;
+                entry.entity = entity;
+                const bool found = ((entry.indexes[Is] = (uint32_t)std::get<Is>(m_managers)->GetIndex(entity),
+                    entry.indexes[Is] != SparseEntityIndex::INVALID_INDEX) && ...);
+                if (found)
+                    m_entries.push_back(entry);
+            }
+
+            return true;
+        }
+
+        template <typename F, size_t... Is>
+        void Invoke(F& func, const Entry& entry, std::index_sequence<Is...>) const
+        {
+            func(entry, (*std::get<Is>(m_managers))[entry.indexes[Is]]...);
+        }
+
+        std::tuple<ComponentManager<Ts>*...> m_managers;
+        std::array<uint64_t, COMPONENT_COUNT> m_versions{};
+        std::vector<Entry> m_entries;
+    };
+
+    namespace detail
+    {
+        // Type erased batch of recorded commands targeting a single component manager.
+        class ComponentCommandBatch
+        {
+        public:
+            virtual ~ComponentCommandBatch() = default;
+            [[nodiscard]] virtual const void* GetManager() const = 0;
+            [[nodiscard]] virtual size_t GetAddCount() const = 0;
+            virtual void ReserveAdds(size_t count) = 0;
+            virtual void PlaybackAdds() = 0;
+            virtual void PlaybackRemoves() = 0;
+        };
+
+        template <typename T>
+        class ComponentCommandBatchT final : public ComponentCommandBatch
+        {
+        public:
+            explicit ComponentCommandBatchT(ComponentManager<T>& manager) :
+                m_manager(&manager)
+            {
+            }
+
+            [[nodiscard]] const void* GetManager() const override { return m_manager; }
+            [[nodiscard]] size_t GetAddCount() const override { return m_addEntities.size(); }
+
+            void ReserveAdds(size_t count) override
+            {
+                m_manager->Reserve(m_manager->Size() + count);
+            }
+
+            void PlaybackAdds() override
+            {
+                for (size_t i = 0; i < m_addEntities.size(); ++i)
+                    m_manager->Create(m_addEntities[i], std::move(m_addComponents[i]));
+                m_addEntities.clear();
+                m_addComponents.clear();
+            }
+
+            void PlaybackRemoves() override
+            {
+                for (Entity entity : m_removeEntities)
+                    m_manager->Remove(entity);
+                m_removeEntities.clear();
+            }
+
+            ComponentManager<T>* m_manager;
+            std::vector<Entity> m_addEntities;
+            std::vector<T> m_addComponents;
+            std::vector<Entity> m_removeEntities;
+        };
+    } // namespace detail
+
+    /**
+     * @brief Records structural changes to be played back later at a sync point.
+     *
+     * A command buffer is owned by a single thread, so recording needs no
+     * locking. Commands are grouped per component manager, and played back
+     * in the following order:
+     *   1. Component adds, in recorded order per manager.
+     *   2. Component removes.
+     *   3. Deferred calls, in recorded order.
+     *   4. Entity destroys.
+     *
+     * Entity handles are allocated immediately by CreateEntity(), so they can
+     * be referenced by other recorded commands and components.
+     */
+    class CommandBuffer
+    {
+    public:
+        CommandBuffer() = default;
+        CommandBuffer(const CommandBuffer&) = delete;
+        CommandBuffer& operator=(const CommandBuffer&) = delete;
+
+        [[nodiscard]] Entity CreateEntity()
+        {
+            return ecs::CreateEntity();
+        }
+
+        // Record a component to be created for entity, the component is constructed right away.
+        template <typename T, typename... Args>
+        void AddComponent(ComponentManager<T>& manager, Entity entity, Args&&... args)
+        {
+            assert(entity != INVALID_ENTITY);
+            auto& batch = GetBatch(manager);
+            batch.m_addEntities.push_back(entity);
+            batch.m_addComponents.emplace_back(std::forward<Args>(args)...);
+        }
+
+        template <typename T>
+        void RemoveComponent(ComponentManager<T>& manager, Entity entity)
+        {
+            GetBatch(manager).m_removeEntities.push_back(entity);
+        }
+
+        // Record a call to be made during playback, for changes not covered by the other commands.
+        template <typename F>
+        void Defer(F&& func)
+        {
+            m_deferred.emplace_back(std::forward<F>(func));
+        }
+
+        // Record an entity handle to be released after all other commands.
+        void DestroyEntity(Entity entity)
+        {
+            m_destroyEntities.push_back(entity);
+        }
+
+        [[nodiscard]] bool IsEmpty() const
+        {
+            return m_batches.empty() && m_deferred.empty() && m_destroyEntities.empty();
+        }
+
+        // Play back and clear all recorded commands.
+        void Playback()
+        {
+            CommandBuffer* buffer = this;
+            Playback({ &buffer, 1 });
+        }
+
+        /**
+         * @brief Play back and clear multiple command buffers, in the order of
+         *        the buffers. Memory for all component adds are reserved up front.
+         */
+        static void Playback(std::span<CommandBuffer* const> buffers)
+        {
+            // Sum up the number of adds per manager, and reserve them all at once.
+            std::vector<std::pair<detail::ComponentCommandBatch*, size_t>> reservations;
+            for (CommandBuffer* buffer : buffers)
+            {
+                for (const auto& batch : buffer->m_batches)
+                {
+                    auto it = std::find_if(reservations.begin(), reservations.end(), [&] (const auto& reservation) {
+                        return reservation.first->GetManager() == batch->GetManager();
+                    });
+                    if (it == reservations.end())
+                        reservations.emplace_back(batch.get(), batch->GetAddCount());
+                    else
+                        it->second += batch->GetAddCount();
+                }
+            }
+
+            for (auto& [batch, count] : reservations)
+                batch->ReserveAdds(count);
+
+            for (CommandBuffer* buffer : buffers)
+            {
+                for (const auto& batch : buffer->m_batches)
+                    batch->PlaybackAdds();
+            }
+            for (CommandBuffer* buffer : buffers)
+            {
+                for (const auto& batch : buffer->m_batches)
+                    batch->PlaybackRemoves();
+            }
+            for (CommandBuffer* buffer : buffers)
+            {
+                for (auto& func : buffer->m_deferred)
+                    func();
+            }
+            for (CommandBuffer* buffer : buffers)
+            {
+                for (Entity entity : buffer->m_destroyEntities)
+                    ecs::DestroyEntity(entity);
+            }
+
+            for (CommandBuffer* buffer : buffers)
+            {
+                buffer->m_batches.clear();
+                buffer->m_deferred.clear();
+                buffer->m_destroyEntities.clear();
+            }
+        }
+
+    private:
+        template <typename T>
+        detail::ComponentCommandBatchT<T>& GetBatch(ComponentManager<T>& manager)
+        {
+            // Only a handful of managers are used, so a linear search is fine.
+            for (const auto& batch : m_batches)
+            {
+                if (batch->GetManager() == &manager)
+                    return static_cast<detail::ComponentCommandBatchT<T>&>(*batch);
+            }
+
+            auto& batch = m_batches.emplace_back(std::make_unique<detail::ComponentCommandBatchT<T>>(manager));
+            return static_cast<detail::ComponentCommandBatchT<T>&>(*batch);
+        }
+
+        std::vector<std::unique_ptr<detail::ComponentCommandBatch>> m_batches;
+        std::vector<std::function<void()>> m_deferred;
+        std::vector<Entity> m_destroyEntities;
+    };
+
+    /**
+     * @brief A set of command buffers, one pair per recording thread.
+     *
+     * Any thread can record into it's own buffer without synchronizing with
+     * other threads, while Playback() applies all of them in bulk. Playback()
+     * swaps each recorded buffer for the empty one of the pair under the lock,
+     * so other threads can keep recording while the detached buffers are
+     * played back. A buffer is never swapped while a Recorder is holding it,
+     * such commands are played back by the next Playback() instead.
+     */
+    class CommandQueue
+    {
+    private:
+        struct ThreadBuffers
+        {
+            std::thread::id threadID;
+            std::unique_ptr<CommandBuffer> recording{ std::make_unique<CommandBuffer>() };
+            std::unique_ptr<CommandBuffer> playback{ std::make_unique<CommandBuffer>() };
+            uint32_t recorderCount{ 0 };
+        };
+
+    public:
+        /**
+         * @brief Scoped access to the command buffer of the calling thread.
+         *        The buffer must not be used after the recorder is destroyed,
+         *        as it may be detached for playback any time after that.
+         */
+        class Recorder
+        {
+        public:
+            Recorder(SpinLock& lock, ThreadBuffers& buffers) :
+                m_lock(&lock),
+                m_buffers(&buffers),
+                m_buffer(buffers.recording.get())
+            {
+            }
+
+            ~Recorder()
+            {
+                std::scoped_lock lock(*m_lock);
+                --m_buffers->recorderCount;
+            }
+
+            Recorder(const Recorder&) = delete;
+            Recorder& operator=(const Recorder&) = delete;
+
+            [[nodiscard]] CommandBuffer& operator*() const { return *m_buffer; }
+            [[nodiscard]] CommandBuffer* operator->() const { return m_buffer; }
+
+        private:
+            SpinLock* m_lock;
+            ThreadBuffers* m_buffers;
+            CommandBuffer* m_buffer;
+        };
+
+        /**
+         * @brief Start recording into the command buffer of the calling thread.
+         *        Takes a lock, so prefer to keep the recorder for a whole job
+         *        rather than creating one per command.
+         */
+        [[nodiscard]] Recorder Record()
+        {
+            const std::thread::id threadID = std::this_thread::get_id();
+            std::scoped_lock lock(m_lock);
+            auto it = std::find_if(m_buffers.begin(), m_buffers.end(), [&] (const auto& buffers) {
+                return buffers->threadID == threadID;
+            });
+            if (it == m_buffers.end())
+            {
+                it = m_buffers.emplace(m_buffers.end(), std::make_unique<ThreadBuffers>());
+                (*it)->threadID = threadID;
+            }
+
+            ++(*it)->recorderCount;
+            return Recorder(m_lock, **it);
+        }
+
+        /**
+         * @brief Play back and clear the commands of all threads not currently
+         *        recording. Must not be called from more than one thread at a time.
+         */
+        void Playback()
+        {
+            std::vector<CommandBuffer*> buffers;
+            {
+                std::scoped_lock lock(m_lock);
+                buffers.reserve(m_buffers.size());
+                for (auto& threadBuffers : m_buffers)
+                {
+                    if (threadBuffers->recorderCount == 0 && !threadBuffers->recording->IsEmpty())
+                    {
+                        std::swap(threadBuffers->recording, threadBuffers->playback);
+                        buffers.push_back(threadBuffers->playback.get());
+                    }
+                }
+            }
+
+            // Detached buffers are only touched by Playback(), and are left
+            // empty to be swapped in again.
+            CommandBuffer::Playback(buffers);
+        }
+
+    private:
+        SpinLock m_lock;
+        std::vector<std::unique_ptr<ThreadBuffers>> m_buffers;
     };
-}
\ No newline at end of file
+}
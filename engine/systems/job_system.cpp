@@ -1,12 +1,17 @@
 #include <thread>
 #include <semaphore>
 #include <mutex>
-#include <condition_variable>
+#include <deque>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
 #include <cassert>
 #ifdef _WIN32
 #include <Windows.h>
 #endif
-#include "core/atomic_queue.h"
+#include "core/work_stealing_deque.h"
+#include "core/spinlock.h"
 #include "core/sys.h"
 #include "core/logger.h"
 #include "core/non_copyable.h"
@@ -14,31 +19,168 @@
 
 namespace cyb::jobsystem
 {
-    struct Job : private MovableNonCopyable
+    // A thread-safe pool of fixed size objects. Each thread keeps a small cache
+    // of free objects and exchanges them in batches with a shared free list, so
+    // objects allocated on one thread and released on an other are recycled.
+    // Memory is never returned to the system until the pool is destroyed.
+    // NOTE: The thread caches are per type, so only one pool per type is allowed!
+    template <typename T>
+    class ObjectPool : private NonCopyable
     {
-        std::function<void(JobArgs)> task;
+    public:
+        [[nodiscard]] void* Allocate()
+        {
+            std::vector<void*>& cache = GetThreadCache();
+            if (cache.empty())
+                Refill(cache);
+
+            void* ptr = cache.back();
+            cache.pop_back();
+            return ptr;
+        }
+
+        void Free(void* ptr)
+        {
+            std::vector<void*>& cache = GetThreadCache();
+            cache.push_back(ptr);
+
+            // Return a batch to the shared list if the cache grows too large.
+            if (cache.size() >= BATCH_SIZE * 2)
+            {
+                std::scoped_lock lock(m_lock);
+                m_free.insert(m_free.end(), cache.end() - BATCH_SIZE, cache.end());
+                cache.resize(cache.size() - BATCH_SIZE);
+            }
+        }
+
+    private:
+        static constexpr size_t BATCH_SIZE = 64;
+
+        struct Slot
+        {
+            alignas(T) std::byte data[sizeof(T)];
+        };
+
+        [[nodiscard]] static std::vector<void*>& GetThreadCache()
+        {
+            static thread_local std::vector<void*> cache = [] {
+                std::vector<void*> temp;
+                temp.reserve(BATCH_SIZE * 2);
+                return temp;
+            }();
+            return cache;
+        }
+
+        void Refill(std::vector<void*>& cache)
+        {
+            std::scoped_lock lock(m_lock);
+            if (m_free.size() < BATCH_SIZE)
+            {
+                Slot* chunk = m_chunks.emplace_back(std::make_unique<Slot[]>(BATCH_SIZE)).get();
+                for (size_t i = 0; i < BATCH_SIZE; ++i)
+                    m_free.push_back(&chunk[i]);
+            }
+
+            cache.insert(cache.end(), m_free.end() - BATCH_SIZE, m_free.end());
+            m_free.resize(m_free.size() - BATCH_SIZE);
+        }
+
+        SpinLock m_lock;
+        std::vector<void*> m_free;
+        std::vector<std::unique_ptr<Slot[]>> m_chunks;
+    };
+
+    struct Job
+    {
+        JobTask* task{ nullptr };
         Context* ctx{ nullptr };
         uint32_t groupJobOffset{ 0 };
         uint32_t groupJobEnd{ 0 };
 
-        uint32_t Execute()
+        void Execute();
+    };
+
+    static ObjectPool<JobTask> taskPool;
+    static ObjectPool<Job> jobPool;
+
+    // Blend a measured group execution time into the running estimate.
+    static void RecordCost(detail::ParallelForCost& cost, uint32_t jobCount, std::chrono::nanoseconds elapsed)
+    {
+        const float sample = (float)elapsed.count() / (float)jobCount;
+        const float estimate = cost.nsPerJob.load(std::memory_order_relaxed);
+        cost.nsPerJob.store(estimate > 0.0f ? estimate + (sample - estimate) * 0.25f : sample, std::memory_order_relaxed);
+    }
+
+    void Job::Execute()
+    {
+        detail::ParallelForCost* cost = task->m_cost;
+        const auto startTime = cost ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+
+        for (uint32_t i = groupJobOffset; i < groupJobEnd; ++i)
         {
-            for (uint32_t i = groupJobOffset; i < groupJobEnd; ++i)
-            {
-                JobArgs args{};
-                args.jobIndex = i;
-                args.groupIndex = i - groupJobOffset;
-                args.isFirstJobInGroup = (i == groupJobOffset);
-                args.isLastJobInGroup = (i == groupJobEnd - 1);
-                task(std::move(args));
-            }
+            JobArgs args{};
+            args.jobIndex = i;
+            args.groupIndex = i - groupJobOffset;
+            args.isFirstJobInGroup = (i == groupJobOffset);
+            args.isLastJobInGroup = (i == groupJobEnd - 1);
+            (*task)(std::move(args));
+        }
+
+        if (cost != nullptr)
+            RecordCost(*cost, groupJobEnd - groupJobOffset, std::chrono::steady_clock::now() - startTime);
 
-            return ctx->remainingJobCount.fetch_sub(1, std::memory_order_acq_rel);
+        // The last group referencing the task destroys it, before the context
+        // is signaled so all captured resources are released once it's done.
+        if (task->m_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            task->~JobTask();
+            taskPool.Free(task);
+        }
+
+        detail::SignalJobFinished(*ctx);
+    }
+
+    // Jobs are referenced by pointer in the deques, as the deque requires
+    // trivially copyable elements for lock-free stealing.
+    using JobQueue = WorkStealingDeque<Job*>;
+
+    static constexpr uint32_t INVALID_QUEUE = ~0u;
+
+    // Index of the queues owned by the calling thread. Worker threads owns
+    // queue [0, numThreads), the main thread owns queue numThreads and the
+    // background workers owns the queues after that. Any other thread has
+    // no queue and submits through the shared queue.
+    static thread_local uint32_t t_queueIndex = INVALID_QUEUE;
+
+    // Statistics owned by a single thread. Only written by the owner, but
+    // read by anyone, so they are kept as relaxed atomics.
+    struct alignas(std::hardware_destructive_interference_size) ThreadCounters
+    {
+        std::atomic<uint64_t> jobsExecuted{ 0 };
+        std::atomic<uint64_t> jobsStolen{ 0 };
+        std::atomic<uint64_t> wakeCount{ 0 };
+        std::atomic<uint64_t> busyTimeNs{ 0 };
+        std::atomic<uint64_t> idleTimeNs{ 0 };
+        std::atomic<uint64_t> wakeLatencyNs{ 0 };
+
+        static void Add(std::atomic<uint64_t>& counter, uint64_t value)
+        {
+            counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
         }
     };
 
-    static constexpr size_t JOB_QUEUE_MAX_SIZE = 1024;
-    using JobQueue = AtomicCircularQueue<Job, JOB_QUEUE_MAX_SIZE>;
+    [[nodiscard]] static uint64_t NowNs()
+    {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Each priority level has it's own set of queues.
+    struct PriorityQueues
+    {
+        std::vector<JobQueue> queuePerThread;
+        std::deque<Job*> sharedQueue;
+        SpinLock sharedQueueLock;
+    };
 
     // This structure is responsible to stop worker thread loops
     // once this is destroyed, worker threads will be woken up and end their loops.
@@ -46,94 +188,325 @@ namespace cyb::jobsystem
     {
         uint32_t numCores{ 0 };
         uint32_t numThreads{ 0 };
+        uint32_t numBackgroundThreads{ 0 };
         std::thread::id mainThreadId;
-        std::vector<JobQueue> jobQueuePerThread;
+        std::array<PriorityQueues, (size_t)Priority::Count> queues;
+        std::unique_ptr<ThreadCounters[]> counters;     // one per queue
+        std::atomic<uint64_t> sharedQueueSubmits{ 0 };
         std::counting_semaphore<> wakeSemaphore{ 0 };
-        std::atomic<uint32_t> nextQueue{ 0 };
+        std::counting_semaphore<> backgroundWakeSemaphore{ 0 };
+        std::atomic<uint64_t> wakeRequestTime{ 0 };
+        std::atomic<uint64_t> backgroundWakeRequestTime{ 0 };
         std::vector<std::jthread> threads;
-        std::mutex waitMutex;
-        std::condition_variable waitCondition;
+        std::vector<ContextAwaiter*> awaiters;      // suspended coroutines, guarded by awaitersLock
+        std::atomic<uint32_t> awaiterCount{ 0 };
+        SpinLock awaitersLock;
+
+        // Threads waiting on a context sleep on the event its address maps
+        // to, rather than on the context itself. The events outlive every
+        // context, so the thread finishing the last job can still notify
+        // after the waiter has returned and destroyed the context. Contexts
+        // sharing an event only cause spurious wakeups.
+        static constexpr uint32_t WAIT_EVENT_COUNT = 64;
+        std::array<std::atomic<uint32_t>, WAIT_EVENT_COUNT> waitEvents{};
+
+        [[nodiscard]] std::atomic<uint32_t>& GetWaitEvent(const Context* ctx)
+        {
+            const uintptr_t address = reinterpret_cast<uintptr_t>(ctx);
+            return waitEvents[(address / alignof(Context)) % WAIT_EVENT_COUNT];
+        }
+
+        [[nodiscard]] bool IsBackgroundQueue(uint32_t queueIndex) const
+        {
+            return queueIndex != INVALID_QUEUE && queueIndex > numThreads;
+        }
 
-        void Submit(Job&& job)
+        void Submit(Job* job, Priority priority)
         {
             // If jobsystem is not initilized, execute the job immediately here.
             if (numThreads == 0)
             {
-                job.Execute();
+                job->Execute();
+                jobPool.Free(job);
                 return;
             }
 
-            auto& queue = jobQueuePerThread[nextQueue.fetch_add(1) % numThreads];
-
-            // If the queue is full, execute the job immidietly on the main thread.
-            if (!queue.Push(std::move(job)))
+            PriorityQueues& priorityQueues = queues[(size_t)priority];
+            if (t_queueIndex != INVALID_QUEUE)
             {
-                assert(0);          // break if debug mode
-                job.Execute();
+                // Owner pushes to the bottom of it's own queue, keeping the
+                // job on this core unless someone steals it.
+                priorityQueues.queuePerThread[t_queueIndex].Push(job);
+            }
+            else
+            {
+                std::scoped_lock lock(priorityQueues.sharedQueueLock);
+                priorityQueues.sharedQueue.push_back(job);
+                sharedQueueSubmits.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        // Wake up as many workers serving the priority as there is work for.
+        void WakeWorkers(Priority priority, uint32_t jobCount)
+        {
+            if (numThreads == 0)
                 return;
+
+            if (priority == Priority::Background)
+            {
+                backgroundWakeRequestTime.store(NowNs(), std::memory_order_relaxed);
+                backgroundWakeSemaphore.release(std::min(jobCount, numBackgroundThreads));
+            }
+            else
+            {
+                wakeRequestTime.store(NowNs(), std::memory_order_relaxed);
+                wakeSemaphore.release(std::min(jobCount, numThreads));
             }
-            wakeSemaphore.release();
         }
 
-        ~InternalState()
+        // Stop and join all threads, leaving the jobsystem uninitialized.
+        void Shutdown()
         {
             for (auto& thread : threads)
                 thread.request_stop();
 
-            wakeSemaphore.release(wakeSemaphore.max());
+            // Each sleeping thread needs one wakeup to notice the stop request.
+            wakeSemaphore.release(numThreads);
+            backgroundWakeSemaphore.release(numBackgroundThreads);
 
             for (auto& thread : threads)
                 thread.join();
+            threads.clear();
+
+            // Drop wakeups not consumed by the stopped threads, so they won't
+            // leak into the threads of a new initialization.
+            while (wakeSemaphore.try_acquire()) {}
+            while (backgroundWakeSemaphore.try_acquire()) {}
+
+            for (auto& priorityQueues : queues)
+            {
+                priorityQueues.queuePerThread.clear();
+                priorityQueues.sharedQueue.clear();
+            }
+            counters.reset();
+            numThreads = 0;
+            numBackgroundThreads = 0;
+        }
+
+        ~InternalState()
+        {
+            Shutdown();
         }
     };
 
     static InternalState internal_state{};
 
-    // Start working on a job queue. After the job queue is finished, it 
-    // can switch to an other queue and steal jobs from there.
-    static void Work(uint32_t startingQueue)
+    // Cheap per-thread xorshift generator used for picking steal victims.
+    [[nodiscard]] static uint32_t NextRandomVictim()
+    {
+        static thread_local uint32_t state = 0x9E3779B9u ^ static_cast<uint32_t>(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    // Find the next job of a single priority: first pop our own queue (LIFO),
+    // then take from the shared queue and finally try to steal (FIFO) from
+    // the other queues, starting at a random victim.
+    [[nodiscard]] static Job* FindJob(PriorityQueues& priorityQueues, uint32_t queueIndex)
+    {
+        if (queueIndex != INVALID_QUEUE)
+        {
+            if (auto job = priorityQueues.queuePerThread[queueIndex].Pop())
+                return *job;
+        }
+
+        {
+            std::scoped_lock lock(priorityQueues.sharedQueueLock);
+            if (!priorityQueues.sharedQueue.empty())
+            {
+                Job* job = priorityQueues.sharedQueue.front();
+                priorityQueues.sharedQueue.pop_front();
+                return job;
+            }
+        }
+
+        const uint32_t queueCount = (uint32_t)priorityQueues.queuePerThread.size();
+        const uint32_t victimOffset = NextRandomVictim();
+        for (uint32_t i = 0; i < queueCount; ++i)
+        {
+            const uint32_t victim = (victimOffset + i) % queueCount;
+            if (victim == queueIndex)
+                continue;
+
+            if (auto job = priorityQueues.queuePerThread[victim].Steal())
+            {
+                if (queueIndex != INVALID_QUEUE)
+                    ThreadCounters::Add(internal_state.counters[queueIndex].jobsStolen, 1);
+                return *job;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // Find the next job for the queue owner. Background workers only execute
+    // background jobs, while all other threads drain high priority jobs before
+    // normal priority jobs, and never pick up any background jobs.
+    [[nodiscard]] static Job* FindJob(uint32_t queueIndex)
     {
-        for (uint32_t i = 0; i < internal_state.numThreads; ++i)
+        if (internal_state.IsBackgroundQueue(queueIndex))
+            return FindJob(internal_state.queues[(size_t)Priority::Background], queueIndex);
+
+        if (Job* job = FindJob(internal_state.queues[(size_t)Priority::High], queueIndex))
+            return job;
+
+        return FindJob(internal_state.queues[(size_t)Priority::Normal], queueIndex);
+    }
+
+    // Execute jobs until there is no more work to be found in any queue.
+    static void Work(uint32_t queueIndex)
+    {
+        uint64_t jobsExecuted = 0;
+        while (Job* job = FindJob(queueIndex))
+        {
+            job->Execute();
+            jobPool.Free(job);
+            ++jobsExecuted;
+        }
+
+        if (queueIndex != INVALID_QUEUE)
+            ThreadCounters::Add(internal_state.counters[queueIndex].jobsExecuted, jobsExecuted);
+    }
+
+    // Worker main loop, executing jobs until there is no more work and then
+    // sleeping on the semaphore until woken up by a submitting thread.
+    static void WorkerLoop(const std::stop_token& stopToken, uint32_t queueIndex, std::counting_semaphore<>& semaphore, const std::atomic<uint64_t>& wakeRequestTime)
+    {
+        t_queueIndex = queueIndex;
+        ThreadCounters& counters = internal_state.counters[queueIndex];
+
+        while (!stopToken.stop_requested())
         {
-            JobQueue& queue = internal_state.jobQueuePerThread[(startingQueue + i) % internal_state.numThreads];
-            while (auto job = queue.Pop())
+            const uint64_t busyStart = NowNs();
+            Work(queueIndex);
+            const uint64_t idleStart = NowNs();
+            ThreadCounters::Add(counters.busyTimeNs, idleStart - busyStart);
+
+            semaphore.acquire();
+
+            // The wake request time is from the latest submit, which might not
+            // be the one waking this thread, so latency is an approximation.
+            const uint64_t wakeTime = NowNs();
+            const uint64_t requestTime = wakeRequestTime.load(std::memory_order_relaxed);
+            ThreadCounters::Add(counters.idleTimeNs, wakeTime - idleStart);
+            ThreadCounters::Add(counters.wakeCount, 1);
+            if (requestTime > idleStart && requestTime <= wakeTime)
+                ThreadCounters::Add(counters.wakeLatencyNs, wakeTime - requestTime);
+        }
+    }
+
+    // Submit a job resuming a coroutine that was suspended on a context. The
+    // same address might have been reused by a new context since the awaiter
+    // was registered, so it's only resumed if the context is still finished.
+    static void ResumeAwaiter(ContextAwaiter* awaiter)
+    {
+        const AsyncTask::promise_type& promise = awaiter->handle.promise();
+        JobTask* task = new (detail::AllocateTask()) JobTask([awaiter] (JobArgs) {
+            const AsyncTask::Handle coroutine = awaiter->handle;
+            if (!detail::RegisterAwaiter(*awaiter))
+                coroutine.resume();
+        });
+        detail::Submit(*promise.ctx, task, 1, 1, promise.priority);
+    }
+
+    // If it was the last job, the context continuation is invoked and waiting
+    // threads and coroutines are woken up.
+    void detail::SignalJobFinished(Context& ctx)
+    {
+        // Grab the continuation before decrementing, as the context might be
+        // destroyed by a waiting thread as soon as the counter reaches zero.
+        const auto onFinished = ctx.onFinished;
+        void* onFinishedUserData = ctx.onFinishedUserData;
+        std::atomic<uint32_t>& waitEvent = internal_state.GetWaitEvent(&ctx);
+
+        if (ctx.remainingJobCount.fetch_sub(1, std::memory_order_seq_cst) == 1)
+        {
+            if (onFinished != nullptr)
+                onFinished(onFinishedUserData);
+
+            // Pairs with Wait() which reads the event before checking the
+            // counter, so either it sees the counter reach zero or the event
+            // change.
+            waitEvent.fetch_add(1, std::memory_order_seq_cst);
+            waitEvent.notify_all();
+
+            // Pairs with RegisterAwaiter() which increments the awaiter count
+            // before checking the context, so either the awaiter sees the
+            // context finished or we see the awaiter.
+            if (internal_state.awaiterCount.load(std::memory_order_seq_cst) == 0)
+                return;
+
+            // Only compare addresses here, the context must not be touched.
+            std::vector<ContextAwaiter*> resumed;
             {
-                const uint32_t progressBefore = job->Execute();
-
-                // If progressBefore is 1, previous job was the last one and we
-                // can wake up the waiting threads.
-                if (progressBefore == 1)
-                {
-                    std::unique_lock<std::mutex> lock(internal_state.waitMutex);
-                    internal_state.waitCondition.notify_all();
-                }
+                std::scoped_lock lock(internal_state.awaitersLock);
+                std::erase_if(internal_state.awaiters, [&] (ContextAwaiter* awaiter) {
+                    if (awaiter->awaited != &ctx)
+                        return false;
+                    resumed.push_back(awaiter);
+                    return true;
+                });
+                internal_state.awaiterCount.fetch_sub((uint32_t)resumed.size(), std::memory_order_relaxed);
             }
+
+            for (ContextAwaiter* awaiter : resumed)
+                ResumeAwaiter(awaiter);
         }
     }
 
-    void Initialize()
+    bool detail::RegisterAwaiter(ContextAwaiter& awaiter)
+    {
+        std::scoped_lock lock(internal_state.awaitersLock);
+        internal_state.awaiterCount.fetch_add(1, std::memory_order_seq_cst);
+        if (awaiter.awaited->remainingJobCount.load(std::memory_order_seq_cst) == 0)
+        {
+            internal_state.awaiterCount.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        internal_state.awaiters.push_back(&awaiter);
+        return true;
+    }
+
+    void Initialize(uint32_t maxThreadCount)
     {
         assert(internal_state.numThreads == 0 && "allready initialized");
+        assert(maxThreadCount > 0);
 
         // Get number of cores on system and and use that to set number of thread
-        // saving one for the main thread.
+        // saving one for the main thread. Background jobs gets their own set of
+        // lower priority threads, so they can never occupy the frame workers.
         internal_state.numCores = std::thread::hardware_concurrency();
-        internal_state.numThreads = std::max(1u, internal_state.numCores - 1);
+        internal_state.numThreads = std::clamp(internal_state.numCores - 1, 1u, maxThreadCount);
+        internal_state.numBackgroundThreads = std::max(1u, internal_state.numThreads / 2);
+        const uint32_t queueCount = internal_state.numThreads + 1 + internal_state.numBackgroundThreads;
+        for (auto& priorityQueues : internal_state.queues)
         {
-            std::vector<JobQueue> temp{ internal_state.numThreads };
-            internal_state.jobQueuePerThread = std::move(temp);
+            // One queue per thread, including the main thread.
+            std::vector<JobQueue> temp(queueCount);
+            priorityQueues.queuePerThread = std::move(temp);
         }
+        internal_state.counters = std::make_unique<ThreadCounters[]>(queueCount);
         internal_state.mainThreadId = std::this_thread::get_id();
+        t_queueIndex = internal_state.numThreads;
 
-        internal_state.threads.reserve(internal_state.numThreads);
+        internal_state.threads.reserve(internal_state.numThreads + internal_state.numBackgroundThreads);
         for (uint32_t threadID = 0; threadID < internal_state.numThreads; ++threadID)
         {
             std::jthread& worker = internal_state.threads.emplace_back([threadID](const std::stop_token stopToken) {
-                while (!stopToken.stop_requested())
-                {
-                    Work(threadID);
-                    internal_state.wakeSemaphore.acquire();
-                }
+                WorkerLoop(stopToken, threadID, internal_state.wakeSemaphore, internal_state.wakeRequestTime);
             });
 
 #if defined(_WIN32)
@@ -150,7 +523,33 @@ namespace cyb::jobsystem
 #endif // _WIN32
         }
 
-        CYB_INFO("JobSystem Initialized with [{} cores] [{} threads]", internal_state.numCores, internal_state.numThreads);
+        for (uint32_t threadID = 0; threadID < internal_state.numBackgroundThreads; ++threadID)
+        {
+            const uint32_t queueIndex = internal_state.numThreads + 1 + threadID;
+            std::jthread& worker = internal_state.threads.emplace_back([queueIndex](const std::stop_token stopToken) {
+                WorkerLoop(stopToken, queueIndex, internal_state.backgroundWakeSemaphore, internal_state.backgroundWakeRequestTime);
+            });
+
+#if defined(_WIN32)
+            HANDLE handle = (HANDLE)worker.native_handle();
+            std::wstring wthreadname = std::format(L"cyb_bgworker_{}", threadID);
+            HRESULT hr = SetThreadDescription(handle, wthreadname.c_str());
+            assert(SUCCEEDED(hr));
+
+            // Let the OS scheduler prefer the frame workers, background
+            // workers are not bound to any specific core.
+            SetThreadPriority(handle, THREAD_PRIORITY_LOWEST);
+#endif // _WIN32
+        }
+
+        CYB_INFO("JobSystem Initialized with [{} cores] [{} threads] [{} background threads]", internal_state.numCores, internal_state.numThreads, internal_state.numBackgroundThreads);
+    }
+
+    void Shutdown()
+    {
+        assert(internal_state.numThreads == 0 || std::this_thread::get_id() == internal_state.mainThreadId);
+        internal_state.Shutdown();
+        t_queueIndex = INVALID_QUEUE;
     }
 
     uint32_t GetThreadCount()
@@ -158,18 +557,23 @@ namespace cyb::jobsystem
         return internal_state.numThreads;
     }
 
-    void Execute(Context& ctx, const std::function<void(JobArgs)>& task)
+    void GetStatistics(Statistics& stats)
     {
-        // Context state is updated.
-        ctx.remainingJobCount.fetch_add(1);
-
-        Job job;
-        job.ctx = &ctx;
-        job.task = task;
-        job.groupJobOffset = 0;
-        job.groupJobEnd = 1;
+        const uint32_t queueCount = internal_state.counters ? internal_state.numThreads + 1 + internal_state.numBackgroundThreads : 0;
+        stats.threads.resize(queueCount);
+        for (uint32_t i = 0; i < queueCount; ++i)
+        {
+            const ThreadCounters& counters = internal_state.counters[i];
+            ThreadStatistics& thread = stats.threads[i];
+            thread.jobsExecuted = counters.jobsExecuted.load(std::memory_order_relaxed);
+            thread.jobsStolen = counters.jobsStolen.load(std::memory_order_relaxed);
+            thread.wakeCount = counters.wakeCount.load(std::memory_order_relaxed);
+            thread.busyTime = counters.busyTimeNs.load(std::memory_order_relaxed) / 1000000.0;
+            thread.idleTime = counters.idleTimeNs.load(std::memory_order_relaxed) / 1000000.0;
+            thread.wakeLatency = counters.wakeLatencyNs.load(std::memory_order_relaxed) / 1000000.0;
+        }
 
-        internal_state.Submit(std::move(job));
+        stats.sharedQueueSubmits = internal_state.sharedQueueSubmits.load(std::memory_order_relaxed);
     }
 
     // Calculate the amount of job groups to dispatch (overestimate, or "ceil").
@@ -178,28 +582,61 @@ namespace cyb::jobsystem
         return (jobCount + groupSize - 1) / groupSize;
     }
 
-    uint32_t Dispatch(Context& ctx, uint32_t jobCount, uint32_t groupSize, const std::function<void(JobArgs)>& task)
+    // ParallelFor aims for this many groups per thread, so threads finishing
+    // early can steal work from the others.
+    static constexpr uint32_t PARALLEL_FOR_GROUPS_PER_THREAD = 4;
+
+    // Minimum execution time of a ParallelFor group, keeping the scheduling
+    // overhead of cheap jobs low.
+    static constexpr float PARALLEL_FOR_MIN_GROUP_TIME_NS = 20000.0f;
+
+    uint32_t detail::ComputeGroupSize(const ParallelForCost& cost, uint32_t jobCount)
+    {
+        if (internal_state.numThreads == 0)
+            return jobCount;
+
+        const uint32_t threadCount = internal_state.numThreads + 1;
+        uint32_t groupSize = DispatchGroupCount(jobCount, threadCount * PARALLEL_FOR_GROUPS_PER_THREAD);
+
+        const float nsPerJob = cost.nsPerJob.load(std::memory_order_relaxed);
+        if (nsPerJob > 0.0f)
+        {
+            const float minGroupSize = std::ceil(PARALLEL_FOR_MIN_GROUP_TIME_NS / nsPerJob);
+            groupSize = std::max(groupSize, (uint32_t)std::min(minGroupSize, (float)jobCount));
+        }
+
+        return std::min(groupSize, jobCount);
+    }
+
+    void* detail::AllocateTask()
     {
-        if (jobCount == 0 || groupSize == 0)
-            return 0;
+        return taskPool.Allocate();
+    }
 
+    uint32_t detail::Submit(Context& ctx, JobTask* task, uint32_t jobCount, uint32_t groupSize, Priority priority, ParallelForCost* cost)
+    {
+        assert(jobCount > 0 && groupSize > 0);
         const uint32_t groupCount = DispatchGroupCount(jobCount, groupSize);
 
-        // Context state is updated.
+        // Context and task state is updated before any job can be executed.
         ctx.remainingJobCount.fetch_add(groupCount);
+        task->m_refCount.store(groupCount, std::memory_order_relaxed);
+        task->m_cost = cost;
 
         for (uint32_t groupID = 0; groupID < groupCount; ++groupID)
         {
-            // For each group, generate one real job.
-            Job job;
-            job.ctx = &ctx;
-            job.task = task;
-            job.groupJobOffset = groupID * groupSize;
-            job.groupJobEnd = std::min(job.groupJobOffset + groupSize, jobCount);
-
-            internal_state.Submit(std::move(job));
+            // For each group, generate one real job sharing the same task.
+            Job* job = new (jobPool.Allocate()) Job;
+            job->task = task;
+            job->ctx = &ctx;
+            job->groupJobOffset = groupID * groupSize;
+            job->groupJobEnd = std::min(job->groupJobOffset + groupSize, jobCount);
+
+            internal_state.Submit(job, priority);
         }
 
+        internal_state.WakeWorkers(priority, groupCount);
+
         return groupCount;
     }
 
@@ -214,16 +651,117 @@ namespace cyb::jobsystem
     {
         if (IsBusy(ctx))
         {
-            const bool isWorkerThread = (std::this_thread::get_id() != internal_state.mainThreadId);
-            if (ctx.allowWorkOnMainThread || isWorkerThread)
-                Work(internal_state.nextQueue.fetch_add(1) % internal_state.numThreads);
+            // Workers waiting on nested contexts are already accounted as
+            // busy by the worker loop, only track the main thread here.
+            const bool isMainThread = (std::this_thread::get_id() == internal_state.mainThreadId);
+            const bool trackTime = isMainThread && internal_state.counters;
+            const uint64_t busyStart = trackTime ? NowNs() : 0;
+
+            if (ctx.allowWorkOnMainThread || !isMainThread)
+                Work(t_queueIndex);
+
+            const uint64_t idleStart = trackTime ? NowNs() : 0;
+
+            // Sleep on the wait event of the context, so finishing most other
+            // contexts won't wake this thread up.
+            std::atomic<uint32_t>& waitEvent = internal_state.GetWaitEvent(&ctx);
+            for (;;)
+            {
+                const uint32_t event = waitEvent.load(std::memory_order_seq_cst);
+                if (ctx.remainingJobCount.load(std::memory_order_seq_cst) == 0)
+                    break;
+                waitEvent.wait(event, std::memory_order_seq_cst);
+            }
 
-            while (IsBusy(ctx))
+            if (trackTime)
             {
-                // Put thread to sleep until waitCondition is signaled.
-                std::unique_lock<std::mutex> lock(internal_state.waitMutex);
-                internal_state.waitCondition.wait(lock, [&ctx] { return !IsBusy(ctx); });
+                ThreadCounters& counters = internal_state.counters[t_queueIndex];
+                ThreadCounters::Add(counters.busyTimeNs, idleStart - busyStart);
+                ThreadCounters::Add(counters.idleTimeNs, NowNs() - idleStart);
             }
         }
     }
+
+    struct TaskGraph::Node
+    {
+        TaskGraph* graph{ nullptr };
+        Task task;
+        Context ctx;
+        std::vector<TaskID> successors;
+        uint32_t dependencyCount{ 0 };
+        std::atomic<uint32_t> remainingDependencies{ 0 };
+    };
+
+    TaskGraph::TaskGraph() = default;
+    TaskGraph::~TaskGraph() = default;
+
+    TaskGraph::TaskID TaskGraph::Add(Task&& task, std::initializer_list<TaskID> dependencies)
+    {
+        const TaskID id = (TaskID)m_nodes.size();
+        Node& node = *m_nodes.emplace_back(std::make_unique<Node>());
+        node.graph = this;
+        node.task = std::move(task);
+        node.dependencyCount = (uint32_t)dependencies.size();
+
+        // Dependencies can only be made to already added tasks, which
+        // guarantees the graph to be acyclic.
+        for (TaskID dependency : dependencies)
+        {
+            assert(dependency < id);
+            m_nodes[dependency]->successors.push_back(id);
+        }
+
+        return id;
+    }
+
+    void TaskGraph::Run(Context& ctx)
+    {
+        if (m_nodes.empty())
+            return;
+
+        // Each task counts as one job in the run context, which is signaled
+        // when the task and all jobs spawned by it are finished.
+        m_runContext = &ctx;
+        ctx.remainingJobCount.fetch_add((uint32_t)m_nodes.size());
+
+        for (auto& node : m_nodes)
+        {
+            assert(!IsBusy(node->ctx) && "task graph is already running");
+            node->ctx.priority = ctx.priority;
+            node->ctx.onFinished = OnNodeFinished;
+            node->ctx.onFinishedUserData = node.get();
+            node->remainingDependencies.store(node->dependencyCount, std::memory_order_relaxed);
+        }
+
+        for (auto& node : m_nodes)
+        {
+            if (node->dependencyCount == 0)
+                StartNode(*node);
+        }
+    }
+
+    void TaskGraph::StartNode(Node& node)
+    {
+        // The task itself is a job in the node context, so the context won't
+        // finish until both the task and any jobs spawned by it are finished.
+        jobsystem::Execute(node.ctx, [&node] (JobArgs) {
+            node.task(node.ctx);
+        });
+    }
+
+    void TaskGraph::OnNodeFinished(void* userData)
+    {
+        Node& node = *static_cast<Node*>(userData);
+        TaskGraph& graph = *node.graph;
+
+        for (TaskID successorID : node.successors)
+        {
+            Node& successor = *graph.m_nodes[successorID];
+            if (successor.remainingDependencies.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                StartNode(successor);
+        }
+
+        // Graph might be destroyed after this, so don't touch it.
+        detail::SignalJobFinished(*graph.m_runContext);
+    }
 }
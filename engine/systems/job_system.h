@@ -1,6 +1,18 @@
 #pragma once
 #include <atomic>
+#include <cassert>
+#include <concepts>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
 #include <functional>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "core/non_copyable.h"
 
 namespace cyb::jobsystem
 {
@@ -12,6 +24,14 @@ namespace cyb::jobsystem
         bool isLastJobInGroup;
     };
 
+    enum class Priority
+    {
+        High,           // Frame critical work, always executed before normal priority work
+        Normal,         // Default priority
+        Background,     // Long running work, executed on separate threads to never delay frame work
+        Count
+    };
+
     /**
      * @brief Defines a state of execution that can be waited on.
      */
@@ -19,26 +39,169 @@ namespace cyb::jobsystem
     {
         std::atomic<uint32_t> remainingJobCount{ 0 };
         bool allowWorkOnMainThread{ true };
+        Priority priority{ Priority::Normal };
+
+        // Optional callback invoked by the thread finishing the last job of the
+        // context. Used by TaskGraph to start successor tasks.
+        void (*onFinished)(void* userData){ nullptr };
+        void* onFinishedUserData{ nullptr };
     };
 
+    class JobTask;
+
+    namespace detail
+    {
+        // Measured execution time per job of a ParallelFor call site, updated
+        // by the job groups as they finish.
+        struct ParallelForCost
+        {
+            std::atomic<float> nsPerJob{ 0.0f };
+        };
+
+        // Get uninitialized storage for a JobTask from the task pool.
+        [[nodiscard]] void* AllocateTask();
+
+        // Split task into groups and submit them to the job queues. Ownership
+        // of the task is passed to the jobsystem. If cost is set the execution
+        // time of each group is measured and recorded.
+        uint32_t Submit(Context& ctx, JobTask* task, uint32_t jobCount, uint32_t groupSize, Priority priority, ParallelForCost* cost = nullptr);
+
+        // Pick a group size from the job count, the number of threads and the
+        // measured cost of earlier calls.
+        [[nodiscard]] uint32_t ComputeGroupSize(const ParallelForCost& cost, uint32_t jobCount);
+
+        // One cost estimate per task type, which is unique per call site for lambdas.
+        template <typename F>
+        inline ParallelForCost parallelForCost;
+
+        // Decrement the job counter of a context, waking up anyone waiting on
+        // it if it was the last job.
+        void SignalJobFinished(Context& ctx);
+    } // namespace detail
+
+    /**
+     * @brief Type erased job function shared by all the job groups of a dispatch.
+     *
+     * Callables small enough are stored inline, larger ones falls back to a heap
+     * allocation. Tasks are allocated from a pool owned by the jobsystem, so
+     * submitting a task that fits inline will not touch the heap once the pool
+     * is warmed up. Use static_assert(JobTask::FitsInline<decltype(lambda)>) to
+     * guarantee allocation free submission.
+     */
+    class JobTask : private NonCopyable
+    {
+    public:
+        static constexpr size_t INLINE_SIZE = 64;
+
+        template <typename F>
+        static constexpr bool FitsInline =
+            sizeof(std::decay_t<F>) <= INLINE_SIZE &&
+            alignof(std::decay_t<F>) <= alignof(std::max_align_t);
+
+        template <typename F>
+        explicit JobTask(F&& func)
+        {
+            using Fn = std::decay_t<F>;
+            if constexpr (FitsInline<Fn>)
+                m_callable = new (m_storage) Fn(std::forward<F>(func));
+            else
+                m_callable = new Fn(std::forward<F>(func));
+
+            m_invoke = [] (const void* callable, JobArgs args) {
+                (*static_cast<const Fn*>(callable))(args);
+            };
+            m_destroy = [] (void* callable) {
+                if constexpr (FitsInline<Fn>)
+                    static_cast<Fn*>(callable)->~Fn();
+                else
+                    delete static_cast<Fn*>(callable);
+            };
+        }
+
+        ~JobTask()
+        {
+            m_destroy(m_callable);
+        }
+
+        void operator()(JobArgs args) const
+        {
+            m_invoke(m_callable, args);
+        }
+
+    private:
+        friend struct Job;
+        friend uint32_t detail::Submit(Context& ctx, JobTask* task, uint32_t jobCount, uint32_t groupSize, Priority priority, detail::ParallelForCost* cost);
+
+        alignas(std::max_align_t) std::byte m_storage[INLINE_SIZE];
+        void* m_callable{ nullptr };
+        void (*m_invoke)(const void* callable, JobArgs args){ nullptr };
+        void (*m_destroy)(void* callable){ nullptr };
+        std::atomic<uint32_t> m_refCount{ 0 };      // number of jobs still referencing the task
+        detail::ParallelForCost* m_cost{ nullptr }; // measured cost, only set for ParallelFor
+    };
+
+    // The task is invoked concurrently by all job groups, so it must be
+    // callable through a const reference.
+    template <typename F>
+    concept JobFunction = std::invocable<const std::decay_t<F>&, JobArgs>;
+
     /**
      * @brief Initialize the jobsystem. Must be called before any other calls in the subsystem.
      * 
      * This will spawn (Number of available cores)-1 threads assigning them to a seperate
-     * core, saving 1 core for the main thread.
+     * core, saving 1 core for the main thread. A separate set of lower priority threads
+     * is spawned for executing background priority jobs.
+     *
+     * @param maxThreadCount Upper limit of the number of worker threads to spawn.
+     */
+    void Initialize(uint32_t maxThreadCount = ~0u);
+
+    /**
+     * @brief Stop all threads, after which jobs are executed immediately until the jobsystem
+     *        is initialized again. All contexts must be finished before calling this.
      */
-    void Initialize();
+    void Shutdown();
 
     /**
      * @brief Get number of worker threads utilized by the jobsystem.
      */
     uint32_t GetThreadCount();
 
+    /**
+     * @brief Statistics of a single thread in the jobsystem, accumulated since Initialize().
+     */
+    struct ThreadStatistics
+    {
+        uint64_t jobsExecuted{ 0 };
+        uint64_t jobsStolen{ 0 };       // jobs taken from an other threads queue
+        uint64_t wakeCount{ 0 };
+        double busyTime{ 0.0 };         // milliseconds spent executing or looking for jobs
+        double idleTime{ 0.0 };         // milliseconds spent sleeping
+        double wakeLatency{ 0.0 };      // total milliseconds from wake request until the thread is running
+    };
+
+    struct Statistics
+    {
+        // Frame workers [0, GetThreadCount()), followed by the main thread
+        // and the background workers.
+        std::vector<ThreadStatistics> threads;
+        uint64_t sharedQueueSubmits{ 0 };   // jobs submitted by threads not owning a queue
+    };
+
+    /**
+     * @brief Get a snapshot of the jobsystem statistics.
+     */
+    void GetStatistics(Statistics& stats);
+
     /**
      * @brief Execute a task async, the context can be waited on.
      *        If jobsystem hasn't been initialized this will be immidietly executed.
      */
-    void Execute(Context& ctx, const std::function<void(JobArgs)>& task);
+    template <JobFunction F>
+    void Execute(Context& ctx, F&& task)
+    {
+        detail::Submit(ctx, new (detail::AllocateTask()) JobTask(std::forward<F>(task)), 1, 1, ctx.priority);
+    }
 
     /**
      * @brief Create a set of jobs and distribute work among the available threads.
@@ -54,7 +217,36 @@ namespace cyb::jobsystem
      * @param groupSize Number of jobs to pass as a group to each thread.
      * @return The number of actual jobs (groups) created.
      */
-    uint32_t Dispatch(Context& ctx, uint32_t jobCount, uint32_t groupSize, const std::function<void(JobArgs)>& task);
+    template <JobFunction F>
+    uint32_t Dispatch(Context& ctx, uint32_t jobCount, uint32_t groupSize, F&& task)
+    {
+        if (jobCount == 0 || groupSize == 0)
+            return 0;
+
+        return detail::Submit(ctx, new (detail::AllocateTask()) JobTask(std::forward<F>(task)), jobCount, groupSize, ctx.priority);
+    }
+
+    /**
+     * @brief Dispatch jobs with a group size picked by the jobsystem.
+     *
+     * Jobs are split into a few groups per thread for load balancing, while the
+     * execution time of each group is measured so that cheap jobs are grouped
+     * enough to amortize the scheduling overhead. The measurements are shared by
+     * all calls with the same task type, so each lambda adapts on it's own.
+     *
+     * @param jobCount Total number of jobs to dispatch.
+     * @return The number of actual jobs (groups) created.
+     */
+    template <JobFunction F>
+    uint32_t ParallelFor(Context& ctx, uint32_t jobCount, F&& task)
+    {
+        if (jobCount == 0)
+            return 0;
+
+        detail::ParallelForCost& cost = detail::parallelForCost<std::decay_t<F>>;
+        const uint32_t groupSize = detail::ComputeGroupSize(cost, jobCount);
+        return detail::Submit(ctx, new (detail::AllocateTask()) JobTask(std::forward<F>(task)), jobCount, groupSize, ctx.priority, &cost);
+    }
     
     /**
      * @brief @brief Check if context is busy with jobs.
@@ -66,4 +258,209 @@ namespace cyb::jobsystem
      * @brief Wait on context until all jobs are executed.
      */
     void Wait(const Context& ctx);
+
+    /**
+     * @brief A coroutine executed by the jobsystem, started with Spawn().
+     *
+     * A running coroutine can suspend without blocking the worker thread by
+     * awaiting a context, and can move itself to an other priority with
+     * SwitchTo(). Blocking work like file reads or GPU uploads is moved to
+     * the background threads, so async pipelines can be written linearly:
+     *
+     * jobsystem::AsyncTask LoadAsync(std::string filename)
+     * {
+     *     co_await jobsystem::SwitchTo(jobsystem::Priority::Background);
+     *     filesystem::ReadFile(filename, data);
+     *     jobsystem::Context ctx;
+     *     jobsystem::Dispatch(ctx, ...);
+     *     co_await ctx;
+     * }
+     *
+     * jobsystem::Spawn(ctx, LoadAsync("scene.csd"));
+     */
+    class AsyncTask : private NonCopyable
+    {
+    public:
+        struct promise_type;
+        using Handle = std::coroutine_handle<promise_type>;
+
+        struct FinalAwaiter
+        {
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(Handle handle) const noexcept;
+            void await_resume() const noexcept {}
+        };
+
+        struct promise_type
+        {
+            Context* ctx{ nullptr };                    // context the coroutine was spawned into
+            Priority priority{ Priority::Normal };      // priority the coroutine is resumed with
+
+            AsyncTask get_return_object() noexcept { return AsyncTask(Handle::from_promise(*this)); }
+            std::suspend_always initial_suspend() const noexcept { return {}; }
+            FinalAwaiter final_suspend() const noexcept { return {}; }
+            void return_void() const noexcept {}
+            void unhandled_exception() const noexcept { std::terminate(); }
+        };
+
+        AsyncTask(AsyncTask&& other) noexcept :
+            m_handle(std::exchange(other.m_handle, {}))
+        {
+        }
+
+        ~AsyncTask()
+        {
+            // Only set if the coroutine was never spawned.
+            if (m_handle)
+                m_handle.destroy();
+        }
+
+    private:
+        explicit AsyncTask(Handle handle) :
+            m_handle(handle)
+        {
+        }
+
+        friend void Spawn(Context& ctx, AsyncTask&& task);
+
+        Handle m_handle;
+    };
+
+    /**
+     * @brief Suspends a coroutine until the awaited context is finished.
+     */
+    struct ContextAwaiter
+    {
+        const Context* awaited{ nullptr };
+        AsyncTask::Handle handle{};
+
+        bool await_ready() const { return !IsBusy(*awaited); }
+        bool await_suspend(AsyncTask::Handle coroutine);
+        void await_resume() const noexcept {}
+    };
+
+    /**
+     * @brief Reschedules a coroutine as a job with a new priority.
+     */
+    struct PriorityAwaiter
+    {
+        Priority priority{ Priority::Normal };
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(AsyncTask::Handle coroutine) const;
+        void await_resume() const noexcept {}
+    };
+
+    namespace detail
+    {
+        // Submit a job resuming the coroutine, using the priority of the coroutine.
+        inline void Resume(AsyncTask::Handle coroutine)
+        {
+            AsyncTask::promise_type& promise = coroutine.promise();
+            Submit(*promise.ctx, new (AllocateTask()) JobTask([coroutine] (JobArgs) { coroutine.resume(); }), 1, 1, promise.priority);
+        }
+
+        // Register a coroutine to be resumed once the awaited context is finished.
+        // Returns false without registering if the context is no longer busy.
+        bool RegisterAwaiter(ContextAwaiter& awaiter);
+    } // namespace detail
+
+    /**
+     * @brief Start executing a coroutine using the context priority. The context
+     *        is busy until the coroutine returns. A coroutine must never await
+     *        the context it was spawned into.
+     */
+    inline void Spawn(Context& ctx, AsyncTask&& task)
+    {
+        assert(task.m_handle && "coroutine already spawned");
+        AsyncTask::Handle coroutine = std::exchange(task.m_handle, {});
+        coroutine.promise().ctx = &ctx;
+        coroutine.promise().priority = ctx.priority;
+
+        // Keep the context busy until the coroutine reaches it's final suspend point.
+        ctx.remainingJobCount.fetch_add(1);
+        detail::Resume(coroutine);
+    }
+
+    /**
+     * @brief co_await a context from within an AsyncTask.
+     */
+    [[nodiscard]] inline ContextAwaiter operator co_await(const Context& ctx)
+    {
+        return ContextAwaiter{ &ctx };
+    }
+
+    /**
+     * @brief co_await to continue executing the coroutine with another priority.
+     */
+    [[nodiscard]] inline PriorityAwaiter SwitchTo(Priority priority)
+    {
+        return PriorityAwaiter{ priority };
+    }
+
+    inline void AsyncTask::FinalAwaiter::await_suspend(Handle handle) const noexcept
+    {
+        // Destroy the coroutine frame before signaling the context, so all
+        // locals are released once anyone waiting on the context wakes up.
+        Context& ctx = *handle.promise().ctx;
+        handle.destroy();
+        detail::SignalJobFinished(ctx);
+    }
+
+    inline bool ContextAwaiter::await_suspend(AsyncTask::Handle coroutine)
+    {
+        handle = coroutine;
+        return detail::RegisterAwaiter(*this);
+    }
+
+    inline void PriorityAwaiter::await_suspend(AsyncTask::Handle coroutine) const
+    {
+        coroutine.promise().priority = priority;
+        detail::Resume(coroutine);
+    }
+
+    /**
+     * @brief A directed acyclic graph of tasks. A task is started as soon as all
+     *        of it's dependencies, including any jobs they spawned, are finished.
+     *
+     * Each task receives it's own context to dispatch jobs into. The task is not
+     * considered finished until all of those jobs are finished. The graph must
+     * outlive the context it's run with.
+     *
+     * Example usage running B and C in parallel after A is finished:
+     * TaskGraph graph;
+     * TaskGraph::TaskID a = graph.Add([] (Context& ctx) { Dispatch(ctx, ...); });
+     * graph.Add([] (Context& ctx) { ... }, { a });
+     * graph.Add([] (Context& ctx) { ... }, { a });
+     * graph.Run(ctx);
+     * Wait(ctx);
+     */
+    class TaskGraph : private NonCopyable
+    {
+    public:
+        using TaskID = uint32_t;
+        using Task = std::function<void(Context&)>;
+
+        TaskGraph();
+        ~TaskGraph();
+
+        /**
+         * @brief Add a task to the graph.
+         * @param dependencies Previously added tasks that must finish before this task is started.
+         */
+        TaskID Add(Task&& task, std::initializer_list<TaskID> dependencies = {});
+
+        /**
+         * @brief Start all tasks without dependencies. The whole graph can be waited on with ctx.
+         */
+        void Run(Context& ctx);
+
+    private:
+        struct Node;
+        static void StartNode(Node& node);
+        static void OnNodeFinished(void* userData);
+
+        std::vector<std::unique_ptr<Node>> m_nodes;
+        Context* m_runContext{ nullptr };
+    };
 }
@@ -0,0 +1,301 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <iterator>
+#include <span>
+#include <type_traits>
+#include <vector>
+#include "systems/job_system.h"
+
+/**
+ * Parallel building blocks on top of the jobsystem. All algorithms split the
+ * input into blocks that are processed by the jobsystem, and returns once the
+ * work is finished. Inputs small enough to fit in a single block are processed
+ * serially on the calling thread without touching the jobsystem.
+ */
+namespace cyb::jobsystem
+{
+    namespace detail
+    {
+        // Minimum number of elements per block, keeping the per block overhead
+        // low compared to the actual work.
+        constexpr uint32_t PARALLEL_MIN_BLOCK_SIZE = 1024;
+
+        // Split count elements into a few blocks per thread, while keeping each
+        // block at least minBlockSize elements large.
+        [[nodiscard]] inline uint32_t ComputeBlockSize(uint32_t count, uint32_t minBlockSize = PARALLEL_MIN_BLOCK_SIZE)
+        {
+            const uint32_t maxBlockCount = (GetThreadCount() + 1) * 4;
+            return std::max(minBlockSize, (count + maxBlockCount - 1) / maxBlockCount);
+        }
+
+        [[nodiscard]] inline uint32_t ComputeBlockCount(uint32_t count, uint32_t blockSize)
+        {
+            return (count + blockSize - 1) / blockSize;
+        }
+
+        // Invoke func(blockIndex, begin, end) for each block and wait for all of them to finish.
+        template <typename F>
+        void ForEachBlock(uint32_t count, uint32_t blockSize, F&& func)
+        {
+            const uint32_t blockCount = ComputeBlockCount(count, blockSize);
+            if (blockCount == 1)
+            {
+                func(0u, 0u, count);
+                return;
+            }
+
+            Context ctx;
+            Dispatch(ctx, blockCount, 1, [&] (JobArgs args) {
+                const uint32_t begin = args.jobIndex * blockSize;
+                func(args.jobIndex, begin, std::min(begin + blockSize, count));
+            });
+            Wait(ctx);
+        }
+    } // namespace detail
+
+    /**
+     * @brief Reduce count transformed elements in parallel.
+     *
+     * Each block is reduced separately, starting from identity, before the
+     * block results are reduced together, so reduce must be associative.
+     *
+     * Example usage summing a vector:
+     * int sum = ParallelReduce((uint32_t)values.size(), 0, [&] (uint32_t i) { return values[i]; }, std::plus<>());
+     *
+     * @param transform Called with the element index, returning the value to reduce.
+     */
+    template <typename T, typename Transform, typename Reduce>
+    [[nodiscard]] T ParallelReduce(uint32_t count, T identity, Transform&& transform, Reduce&& reduce)
+    {
+        static_assert(!std::is_same_v<T, bool>, "std::vector<bool> can't be written concurrently");
+
+        const uint32_t blockSize = detail::ComputeBlockSize(count);
+        std::vector<T> blockResults(detail::ComputeBlockCount(count, blockSize), identity);
+        detail::ForEachBlock(count, blockSize, [&] (uint32_t block, uint32_t begin, uint32_t end) {
+            T value = identity;
+            for (uint32_t i = begin; i < end; ++i)
+                value = reduce(std::move(value), transform(i));
+            blockResults[block] = std::move(value);
+        });
+
+        T result = identity;
+        for (T& value : blockResults)
+            result = reduce(std::move(result), std::move(value));
+        return result;
+    }
+
+    /**
+     * @brief Exclusive prefix sum, output[i] = init + input[0] + ... + input[i-1].
+     *        Input and output may be the same span.
+     * @return The sum of init and all input elements.
+     */
+    template <typename T>
+    T ParallelExclusiveScan(std::span<const T> input, std::span<T> output, T init = T{})
+    {
+        assert(output.size() >= input.size());
+        const uint32_t count = (uint32_t)input.size();
+        const uint32_t blockSize = detail::ComputeBlockSize(count);
+        const uint32_t blockCount = detail::ComputeBlockCount(count, blockSize);
+
+        // First pass sums up each block, which is scanned serially to get the
+        // starting offset of each block.
+        std::vector<T> blockOffsets(blockCount);
+        if (blockCount > 1)
+        {
+            detail::ForEachBlock(count, blockSize, [&] (uint32_t block, uint32_t begin, uint32_t end) {
+                T sum{};
+                for (uint32_t i = begin; i < end; ++i)
+                    sum += input[i];
+                blockOffsets[block] = sum;
+            });
+        }
+
+        T total = init;
+        for (T& offset : blockOffsets)
+        {
+            const T blockSum = offset;
+            offset = total;
+            total += blockSum;
+        }
+
+        // Second pass scans each block from it's starting offset.
+        detail::ForEachBlock(count, blockSize, [&] (uint32_t block, uint32_t begin, uint32_t end) {
+            T sum = blockOffsets[block];
+            for (uint32_t i = begin; i < end; ++i)
+            {
+                const T value = input[i];
+                output[i] = sum;
+                sum += value;
+            }
+            if (blockCount == 1)
+                total = sum;
+        });
+
+        return total;
+    }
+
+    /**
+     * @brief Stream compaction, gather the indexes in [0, count) accepted by pred.
+     *
+     * The order of the indexes is preserved, and pred is only called once per index.
+     *
+     * @param indexes Output of accepted indexes, resized to the number of accepted indexes.
+     * @return The number of accepted indexes.
+     */
+    template <typename Pred>
+    uint32_t ParallelCompact(uint32_t count, std::vector<uint32_t>& indexes, Pred&& pred)
+    {
+        const uint32_t blockSize = detail::ComputeBlockSize(count);
+        std::vector<uint32_t> blockCounts(detail::ComputeBlockCount(count, blockSize));
+        indexes.resize(count);
+
+        // Each block writes the accepted indexes at the start of it's own range.
+        detail::ForEachBlock(count, blockSize, [&] (uint32_t block, uint32_t begin, uint32_t end) {
+            uint32_t blockCount = 0;
+            for (uint32_t i = begin; i < end; ++i)
+            {
+                if (pred(i))
+                    indexes[begin + blockCount++] = i;
+            }
+            blockCounts[block] = blockCount;
+        });
+
+        // Pack the blocks together. Blocks are only ever moved towards the
+        // front, so doing this in order never overwrites any unmoved block.
+        uint32_t acceptedCount = 0;
+        for (uint32_t block = 0; block < (uint32_t)blockCounts.size(); ++block)
+        {
+            const auto first = indexes.begin() + block * blockSize;
+            std::move(first, first + blockCounts[block], indexes.begin() + acceptedCount);
+            acceptedCount += blockCounts[block];
+        }
+
+        indexes.resize(acceptedCount);
+        return acceptedCount;
+    }
+
+    /**
+     * @brief Stable partition, moving all elements accepted by pred before the
+     *        rest of the elements. Pred is called twice for each element.
+     * @return Index of the first element not accepted by pred.
+     */
+    template <typename T, typename Pred>
+    uint32_t ParallelPartition(std::span<T> data, Pred&& pred)
+    {
+        const uint32_t count = (uint32_t)data.size();
+        const uint32_t blockSize = detail::ComputeBlockSize(count);
+        const uint32_t blockCount = detail::ComputeBlockCount(count, blockSize);
+        if (blockCount <= 1)
+            return (uint32_t)(std::stable_partition(data.begin(), data.end(), pred) - data.begin());
+
+        std::vector<uint32_t> acceptedOffsets(blockCount);
+        detail::ForEachBlock(count, blockSize, [&] (uint32_t block, uint32_t begin, uint32_t end) {
+            acceptedOffsets[block] = (uint32_t)std::count_if(data.begin() + begin, data.begin() + end, pred);
+        });
+
+        const uint32_t acceptedCount = ParallelExclusiveScan<uint32_t>(acceptedOffsets, acceptedOffsets);
+
+        // Scatter into a temporary buffer, accepted elements go to the front
+        // and the rejected ones after them, both in their original order.
+        std::vector<T> temp(count);
+        detail::ForEachBlock(count, blockSize, [&] (uint32_t block, uint32_t begin, uint32_t end) {
+            uint32_t accepted = acceptedOffsets[block];
+            uint32_t rejected = acceptedCount + (begin - acceptedOffsets[block]);
+            for (uint32_t i = begin; i < end; ++i)
+            {
+                if (pred(data[i]))
+                    temp[accepted++] = std::move(data[i]);
+                else
+                    temp[rejected++] = std::move(data[i]);
+            }
+        });
+
+        detail::ForEachBlock(count, blockSize, [&] (uint32_t, uint32_t begin, uint32_t end) {
+            std::move(temp.begin() + begin, temp.begin() + end, data.begin() + begin);
+        });
+
+        return acceptedCount;
+    }
+
+    namespace detail
+    {
+        // Number of elements taken from a when the first k elements of merging
+        // a and b are taken, with equal elements taken from a first as by std::merge.
+        template <typename T, typename Compare>
+        [[nodiscard]] uint32_t MergeSplit(const T* a, uint32_t aCount, const T* b, uint32_t bCount, uint32_t k, Compare& comp)
+        {
+            uint32_t lo = k > bCount ? k - bCount : 0;
+            uint32_t hi = std::min(k, aCount);
+            while (lo < hi)
+            {
+                const uint32_t i = (lo + hi) / 2;
+                if (comp(b[k - i - 1], a[i]))
+                    hi = i;
+                else
+                    lo = i + 1;
+            }
+            return lo;
+        }
+    } // namespace detail
+
+    /**
+     * @brief Sort elements in parallel. Blocks are sorted in parallel and then
+     *        merged pairwise until a single sorted range is left. Each merge is
+     *        split into blocks of output by binary searching the split point of
+     *        the two ranges, so every merge pass runs on all threads. Not stable.
+     */
+    template <typename T, typename Compare = std::less<>>
+    void ParallelSort(std::span<T> data, Compare comp = Compare())
+    {
+        const uint32_t count = (uint32_t)data.size();
+        const uint32_t blockSize = detail::ComputeBlockSize(count);
+        detail::ForEachBlock(count, blockSize, [&] (uint32_t, uint32_t begin, uint32_t end) {
+            std::sort(data.begin() + begin, data.begin() + end, comp);
+        });
+
+        if (blockSize >= count)
+            return;
+
+        // Merge passes ping-pong between data and a temporary buffer.
+        std::vector<T> temp(count);
+        T* src = data.data();
+        T* dst = temp.data();
+        for (uint32_t width = blockSize; width < count; width *= 2)
+        {
+            const uint32_t mergeCount = detail::ComputeBlockCount(count, width * 2);
+            const uint32_t blocksPerMerge = detail::ComputeBlockCount(width * 2, blockSize);
+            detail::ForEachBlock(mergeCount * blocksPerMerge, 1, [&] (uint32_t job, uint32_t, uint32_t) {
+                const uint32_t begin = (job / blocksPerMerge) * width * 2;
+                const uint32_t middle = std::min(begin + width, count);
+                const uint32_t end = std::min(middle + width, count);
+                const uint32_t outBegin = std::min(begin + (job % blocksPerMerge) * blockSize, end);
+                const uint32_t outEnd = std::min(outBegin + blockSize, end);
+                if (outBegin == outEnd)
+                    return;
+
+                const T* a = src + begin;
+                const T* b = src + middle;
+                const uint32_t aCount = middle - begin;
+                const uint32_t bCount = end - middle;
+                const uint32_t aBegin = detail::MergeSplit(a, aCount, b, bCount, outBegin - begin, comp);
+                const uint32_t aEnd = detail::MergeSplit(a, aCount, b, bCount, outEnd - begin, comp);
+                const uint32_t bBegin = (outBegin - begin) - aBegin;
+                const uint32_t bEnd = (outEnd - begin) - aEnd;
+                std::merge(
+                    std::make_move_iterator(src + begin + aBegin), std::make_move_iterator(src + begin + aEnd),
+                    std::make_move_iterator(src + middle + bBegin), std::make_move_iterator(src + middle + bEnd),
+                    dst + outBegin, comp);
+            });
+            std::swap(src, dst);
+        }
+
+        if (src != data.data())
+        {
+            detail::ForEachBlock(count, blockSize, [&] (uint32_t, uint32_t begin, uint32_t end) {
+                std::move(src + begin, src + end, data.data() + begin);
+            });
+        }
+    }
+}
@@ -15,6 +15,33 @@ namespace cyb::profiler
     std::array<rhi::GPUBuffer, rhi::GraphicsDevice::GetBufferCount()> queryResultBuffer = {};
     std::atomic<uint32_t> queryCount = 0;
     uint32_t queryIndex = 0;
+    jobsystem::Statistics jobStatisticsTotal;
+
+    // Replace total with the current jobsystem statistics, storing the
+    // difference since last call in frame.
+    static void UpdateJobStatistics(jobsystem::Statistics& total, jobsystem::Statistics& frame)
+    {
+        jobsystem::Statistics current;
+        jobsystem::GetStatistics(current);
+        total.threads.resize(current.threads.size());
+        frame.threads.resize(current.threads.size());
+
+        for (size_t i = 0; i < current.threads.size(); ++i)
+        {
+            const jobsystem::ThreadStatistics& a = total.threads[i];
+            const jobsystem::ThreadStatistics& b = current.threads[i];
+            jobsystem::ThreadStatistics& delta = frame.threads[i];
+            delta.jobsExecuted = b.jobsExecuted - a.jobsExecuted;
+            delta.jobsStolen = b.jobsStolen - a.jobsStolen;
+            delta.wakeCount = b.wakeCount - a.wakeCount;
+            delta.busyTime = b.busyTime - a.busyTime;
+            delta.idleTime = b.idleTime - a.idleTime;
+            delta.wakeLatency = b.wakeLatency - a.wakeLatency;
+        }
+
+        frame.sharedQueueSubmits = current.sharedQueueSubmits - total.sharedQueueSubmits;
+        total = std::move(current);
+    }
 
     EntryId Context::GetUniqueId(const std::string& name) const
     {
@@ -99,6 +126,8 @@ namespace cyb::profiler
         }
         context.cpuFrameGraph[FRAME_GRAPH_ENTRIES - 1] = context.entries[context.cpuFrame].time;
         context.gpuFrameGraph[FRAME_GRAPH_ENTRIES - 1] = context.entries[context.gpuFrame].time;
+
+        UpdateJobStatistics(jobStatisticsTotal, context.jobStatistics);
     }
 
     void EndFrame(rhi::CommandList cmd)
@@ -2,6 +2,7 @@
 #include <unordered_map>
 #include "core/timer.h"
 #include "graphics/device.h"
+#include "systems/job_system.h"
 
 // On/Off profiler switch
 #define CYB_ENABLE_PROFILER 1
@@ -66,6 +67,7 @@ namespace cyb::profiler
         EntryId gpuFrame = 0;
         std::array<float, FRAME_GRAPH_ENTRIES> cpuFrameGraph = {};
         std::array<float, FRAME_GRAPH_ENTRIES> gpuFrameGraph = {};
+        jobsystem::Statistics jobStatistics;    // jobsystem activity during the last frame
 
         [[nodiscard]] EntryId GetUniqueId(const std::string& name) const;
     };
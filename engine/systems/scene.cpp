@@ -1,6 +1,7 @@
-#include <variant>
+#include <bit>
 #include "core/cvar.h"
 #include "core/logger.h"
+#include "systems/parallel_algorithms.h"
 #include "systems/profiler.h"
 #include "systems/scene.h"
 
@@ -8,7 +9,9 @@ using namespace cyb::rhi;
 
 namespace cyb::scene {
 
-CVar<uint32_t> r_sceneSubtaskGroupsize("r_sceneSubtaskGroupsize", 64, CVarFlag::RendererBit, "Groupsize for multithreaded scene update tasks");
+CVar<bool> r_animationCulling("r_animationCulling", true, CVarFlag::SystemBit, "Evaluate animations with all driven objects outside the camera frustum at the lowest update rate");
+CVar<bool> r_sceneTransformStreams("r_sceneTransformStreams", false, CVarFlag::SystemBit, "Store local transforms and world matrices in SoA streams, computing world matrices in SIMD batches");
+CVar<float> r_animationLODDistance("r_animationLODDistance", 25.0f, 1.0f, 10000.0f, CVarFlag::SystemBit, "Distance where animations drop to half update rate, halving again at each doubling of distance");
 
 void TransformComponent::SetDirty(bool value)
 {
@@ -59,11 +62,13 @@ void TransformComponent::UpdateTransform()
 
     world = GetLocalMatrix();
     SetDirty(false);
+    SetFlag(flags, Flags::WorldUpdatedBit, true);
 }
 
 void TransformComponent::UpdateTransformParented(const TransformComponent& parent)
 {
     world = GetLocalMatrix() * parent.world;
+    SetFlag(flags, Flags::WorldUpdatedBit, true);
 }
 
 void TransformComponent::Translate(const XMFLOAT3& value)
@@ -107,6 +112,7 @@ void MeshComponent::Clear()
     vertex_colors.clear();
     indices.clear();
     subsets.clear();
+    bvh.Clear();
 }
 
 void MeshComponent::CreateRenderData()
@@ -124,6 +130,8 @@ void MeshComponent::CreateRenderData()
     }
 
     aabb.Invalidate();
+    ++revision;
+    BuildBVH();
 
     // vertex_buffer_pos - POSITION + NORMAL
     {
@@ -156,6 +164,18 @@ void MeshComponent::CreateRenderData()
     }
 }
 
+void MeshComponent::BuildBVH()
+{
+    std::vector<uint32_t> triangleOffsets;
+    for (const auto& subset : subsets)
+    {
+        for (uint32_t i = 0; i + 2 < subset.indexCount; i += 3)
+            triangleOffsets.push_back(subset.indexOffset + i);
+    }
+
+    bvh.Build(vertex_positions, indices, std::move(triangleOffsets));
+}
+
 void MeshComponent::ComputeHardNormals()
 {
     std::vector<XMFLOAT3> newPositions;
@@ -342,6 +362,22 @@ void CameraComponent::TransformCamera(const TransformComponent& transform)
     XMStoreFloat3(&up, camUp);
 }
 
+void AnimationComponent::BuildTimelines()
+{
+    timelines.clear();
+    samplerTimelines.resize(samplers.size());
+    for (uint32_t i = 0; i < (uint32_t)samplers.size(); ++i)
+    {
+        const auto it = std::find_if(timelines.begin(), timelines.end(), [&] (const Timeline& timeline) {
+            return samplers[timeline.sampler].keyframeTimes == samplers[i].keyframeTimes;
+        });
+
+        samplerTimelines[i] = (uint32_t)(it - timelines.begin());
+        if (it == timelines.end())
+            timelines.push_back({ .sampler = i });
+    }
+}
+
 ecs::Entity Scene::CreateGroup(const std::string& name)
 {
     ecs::Entity entity = ecs::CreateEntity();
@@ -414,6 +450,74 @@ ecs::Entity Scene::CreateCamera(
     return entity;
 }
 
+static void EraseLinksIfEmpty(std::unordered_map<ecs::Entity, Scene::HierarchyLinks>& links, ecs::Entity entity)
+{
+    auto it = links.find(entity);
+    if (it == links.end())
+        return;
+
+    const Scene::HierarchyLinks& entityLinks = it->second;
+    if (entityLinks.firstChild == ecs::INVALID_ENTITY &&
+        entityLinks.prevSibling == ecs::INVALID_ENTITY &&
+        entityLinks.nextSibling == ecs::INVALID_ENTITY)
+        links.erase(it);
+}
+
+// Append child to the end of parent's children.
+static void LinkChild(std::unordered_map<ecs::Entity, Scene::HierarchyLinks>& links, ecs::Entity parent, ecs::Entity child)
+{
+    if (parent == ecs::INVALID_ENTITY)
+        return;
+
+    Scene::HierarchyLinks& parentLinks = links[parent];
+    Scene::HierarchyLinks& childLinks = links[child];
+    childLinks.prevSibling = parentLinks.lastChild;
+    childLinks.nextSibling = ecs::INVALID_ENTITY;
+    if (parentLinks.lastChild != ecs::INVALID_ENTITY)
+        links[parentLinks.lastChild].nextSibling = child;
+    else
+        parentLinks.firstChild = child;
+    parentLinks.lastChild = child;
+}
+
+static void UnlinkChild(std::unordered_map<ecs::Entity, Scene::HierarchyLinks>& links, ecs::Entity parent, ecs::Entity child)
+{
+    auto it = links.find(child);
+    if (parent == ecs::INVALID_ENTITY || it == links.end())
+        return;
+
+    Scene::HierarchyLinks& childLinks = it->second;
+    Scene::HierarchyLinks& parentLinks = links[parent];
+    if (childLinks.prevSibling != ecs::INVALID_ENTITY)
+        links[childLinks.prevSibling].nextSibling = childLinks.nextSibling;
+    else
+        parentLinks.firstChild = childLinks.nextSibling;
+    if (childLinks.nextSibling != ecs::INVALID_ENTITY)
+        links[childLinks.nextSibling].prevSibling = childLinks.prevSibling;
+    else
+        parentLinks.lastChild = childLinks.prevSibling;
+
+    childLinks.prevSibling = ecs::INVALID_ENTITY;
+    childLinks.nextSibling = ecs::INVALID_ENTITY;
+    EraseLinksIfEmpty(links, child);
+    EraseLinksIfEmpty(links, parent);
+}
+
+// Rebuild the child links if hierarchy was changed behind our back.
+static void UpdateHierarchyLinks(const Scene& scene)
+{
+    std::scoped_lock lock(scene.derivedDataLock);
+    if (scene.hierarchyLinksVersion == scene.hierarchy.GetVersion())
+        return;
+
+    // Linking in component order keeps children in the order they were attached.
+    scene.hierarchyLinks.clear();
+    for (size_t i = 0; i < scene.hierarchy.Size(); ++i)
+        LinkChild(scene.hierarchyLinks, scene.hierarchy[i].parentID, scene.hierarchy.GetEntity(i));
+
+    scene.hierarchyLinksVersion = scene.hierarchy.GetVersion();
+}
+
 void Scene::ComponentAttach(ecs::Entity entity, ecs::Entity parentEntity)
 {
     assert(entity != parentEntity);
@@ -421,19 +525,21 @@ void Scene::ComponentAttach(ecs::Entity entity, ecs::Entity parentEntity)
     if (hierarchy.Contains(entity))
         ComponentDetach(entity);
 
+    UpdateHierarchyLinks(*this);
     HierarchyComponent& component = hierarchy.Create(entity);
     component.parentID = parentEntity;
+    LinkChild(hierarchyLinks, parentEntity, entity);
+    hierarchyLinksVersion = hierarchy.GetVersion();
 
-    TransformComponent* parent = transforms.GetComponent(parentEntity);
-    parent->UpdateTransform();  // ensure parent's world matrix is up to date
+    const TransformComponent* parent = transforms.GetComponent(parentEntity);
     TransformComponent* child = transforms.GetComponent(entity);
     if (parent != nullptr && child != nullptr)
     {
-        // move child to parent's local space
-        XMMATRIX B = XMMatrixInverse(nullptr, parent->world);
-        child->MatrixTransform(B);
-        child->UpdateTransform();
-        child->UpdateTransformParented(*parent);
+        // Move child to parent's local space, keeping it's world matrix. A
+        // parent modified since the last update has it's local matrix as
+        // world, same as UpdateTransform() would give it.
+        const XMMATRIX parentWorld = parent->IsDirty() ? parent->GetLocalMatrix() : GetWorldMatrix(transforms.GetIndex(parentEntity));
+        child->MatrixTransform(XMMatrixInverse(nullptr, parentWorld));
     }
 }
 
@@ -443,24 +549,87 @@ void Scene::ComponentDetach(ecs::Entity entity)
     if (parent == nullptr)
         return;
 
-    TransformComponent* transform = transforms.GetComponent(entity);
-    transform->ApplyTransform();
+    UpdateHierarchyLinks(*this);
+    UnlinkChild(hierarchyLinks, parent->parentID, entity);
+
+    // Keep the world matrix by making it the local transform.
+    const size_t transformIndex = transforms.GetIndex(entity);
+    if (transformIndex != std::numeric_limits<size_t>::max())
+    {
+        TransformComponent& transform = transforms[transformIndex];
+        transform.world = GetWorldMatrix(transformIndex);
+        transform.ApplyTransform();
+    }
     hierarchy.Remove(entity);
+    hierarchyLinksVersion = hierarchy.GetVersion();
 }
 
-uint32_t Scene::GetMeshUseCount(ecs::Entity meshID) const
+ecs::Entity Scene::GetFirstChild(ecs::Entity entity) const
 {
-    if (meshID == ecs::INVALID_ENTITY || !meshes.Contains(meshID))
-        return 0;
+    UpdateHierarchyLinks(*this);
+    auto it = hierarchyLinks.find(entity);
+    return it != hierarchyLinks.end() ? it->second.firstChild : ecs::INVALID_ENTITY;
+}
+
+ecs::Entity Scene::GetNextSibling(ecs::Entity child) const
+{
+    UpdateHierarchyLinks(*this);
+    auto it = hierarchyLinks.find(child);
+    return it != hierarchyLinks.end() ? it->second.nextSibling : ecs::INVALID_ENTITY;
+}
+
+// Rebuild the use counts if objects or meshes were changed behind our back.
+static void UpdateUseCounts(const Scene& scene)
+{
+    std::scoped_lock lock(scene.derivedDataLock);
+    if (scene.useCountsObjectsVersion == scene.objects.GetVersion() &&
+        scene.useCountsMeshesVersion == scene.meshes.GetVersion())
+        return;
+
+    scene.meshUseCounts.clear();
+    for (size_t i = 0; i < scene.objects.Size(); ++i)
+    {
+        if (scene.objects[i].meshID != ecs::INVALID_ENTITY)
+            scene.meshUseCounts[scene.objects[i].meshID]++;
+    }
 
-    uint32_t useCount{ 0 };
-    for (size_t i = 0; i < objects.Size(); ++i)
+    scene.materialUseCounts.clear();
+    for (size_t i = 0; i < scene.meshes.Size(); ++i)
     {
-        if (objects[i].meshID == meshID)
-            useCount++;
+        for (const auto& subset : scene.meshes[i].subsets)
+        {
+            if (subset.materialID != ecs::INVALID_ENTITY)
+                scene.materialUseCounts[subset.materialID]++;
+        }
     }
 
-    return useCount;
+    scene.useCountsObjectsVersion = scene.objects.GetVersion();
+    scene.useCountsMeshesVersion = scene.meshes.GetVersion();
+}
+
+static void AddUse(std::unordered_map<ecs::Entity, uint32_t>& useCounts, ecs::Entity entity)
+{
+    if (entity != ecs::INVALID_ENTITY)
+        useCounts[entity]++;
+}
+
+static void ReleaseUse(std::unordered_map<ecs::Entity, uint32_t>& useCounts, ecs::Entity entity)
+{
+    auto it = useCounts.find(entity);
+    if (it == useCounts.end())
+        return;
+    if (--it->second == 0)
+        useCounts.erase(it);
+}
+
+uint32_t Scene::GetMeshUseCount(ecs::Entity meshID) const
+{
+    if (meshID == ecs::INVALID_ENTITY || !meshes.Contains(meshID))
+        return 0;
+
+    UpdateUseCounts(*this);
+    auto it = meshUseCounts.find(meshID);
+    return it != meshUseCounts.end() ? it->second : 0;
 }
 
 uint32_t Scene::GetMaterialUseCount(ecs::Entity materialID) const
@@ -468,17 +637,31 @@ uint32_t Scene::GetMaterialUseCount(ecs::Entity materialID) const
     if (materialID == ecs::INVALID_ENTITY || !materials.Contains(materialID))
         return 0;
 
-    uint32_t useCount{ 0 };
-    for (size_t i = 0; i < meshes.Size(); ++i)
-    {
-        for (auto& subset : meshes[i].subsets)
-        {
-            if (subset.materialID == materialID)
-                useCount++;
-        }
-    }
+    UpdateUseCounts(*this);
+    auto it = materialUseCounts.find(materialID);
+    return it != materialUseCounts.end() ? it->second : 0;
+}
+
+void Scene::SetObjectMesh(ObjectComponent& object, ecs::Entity meshID)
+{
+    UpdateUseCounts(*this);
+    ReleaseUse(meshUseCounts, object.meshID);
+    AddUse(meshUseCounts, meshID);
+    object.meshID = meshID;
+}
+
+void Scene::SetSubsetMaterial(MeshComponent::MeshSubset& subset, ecs::Entity materialID)
+{
+    UpdateUseCounts(*this);
+    ReleaseUse(materialUseCounts, subset.materialID);
+    AddUse(materialUseCounts, materialID);
+    subset.materialID = materialID;
+}
 
-    return useCount;
+void Scene::InvalidateUseCounts()
+{
+    useCountsObjectsVersion = ~0ull;
+    useCountsMeshesVersion = ~0ull;
 }
 
 void Scene::Update([[maybe_unused]] double dt)
@@ -486,28 +669,55 @@ void Scene::Update([[maybe_unused]] double dt)
     this->dt = dt;
     this->time += dt;
 
-    jobsystem::Context ctx;
+    // Sync point for the structural changes recorded since the last update.
+    commands.Playback();
+    UpdateUseCounts(*this);
+    UpdateHierarchyLinks(*this);
 
-    // update systems with no dependency
-    RunAnimationUpdateSystem(ctx);      // waits on ctx before returning
-    RunTransformUpdateSystem(ctx);
-    RunWeatherUpdateSystem(ctx);
-    jobsystem::Wait(ctx);
+    // Express the systems as a task graph, so that each system is started as
+    // soon as the systems it depends on are finished
+    jobsystem::TaskGraph graph;
 
-    // update systems that only depends on local transform
-    RunHierarchyUpdateSystem(ctx);
-    RunMeshUpdateSystem(ctx);
-    jobsystem::Wait(ctx);
+    // animation writes local transforms, which everything transform related depends on
+    const auto animation = graph.Add([this] (jobsystem::Context& ctx) { RunAnimationUpdateSystem(ctx); });
+    const auto transform = graph.Add([this] (jobsystem::Context& ctx) { RunTransformUpdateSystem(ctx); }, { animation });
+    const auto hierarchy = graph.Add([this] (jobsystem::Context& ctx) { RunHierarchyUpdateSystem(ctx); }, { transform });
 
     // update systems that is dependent on world transform
-    RunObjectUpdateSystem(ctx);
-    RunLightUpdateSystem(ctx);
-    RunCameraUpdateSystem(ctx);
+    const auto object = graph.Add([this] (jobsystem::Context& ctx) { RunObjectUpdateSystem(ctx); }, { hierarchy });
+    graph.Add([this] (jobsystem::Context& ctx) { RunObjectBVHUpdateSystem(ctx); }, { object });
+    graph.Add([this] (jobsystem::Context& ctx) { RunLightUpdateSystem(ctx); }, { hierarchy });
+
+    // update systems with no dependency
+    graph.Add([this] (jobsystem::Context& ctx) { RunMeshUpdateSystem(ctx); });
+    graph.Add([this] (jobsystem::Context& ctx) { RunCameraUpdateSystem(ctx); });
+    graph.Add([this] (jobsystem::Context& ctx) { RunWeatherUpdateSystem(ctx); });
+
+    jobsystem::Context ctx;
+    graph.Run(ctx);
     jobsystem::Wait(ctx);
 }
 
 void Scene::Clear()
 {
+    // Release all entity handles owned by the scene, entities with
+    // components in several managers are only destroyed once.
+    auto destroyEntities = [] (const auto& manager) {
+        for (size_t i = 0; i < manager.Size(); ++i)
+            ecs::DestroyEntity(manager.GetEntity(i));
+    };
+    destroyEntities(names);
+    destroyEntities(transforms);
+    destroyEntities(groups);
+    destroyEntities(hierarchy);
+    destroyEntities(materials);
+    destroyEntities(meshes);
+    destroyEntities(objects);
+    destroyEntities(lights);
+    destroyEntities(cameras);
+    destroyEntities(animations);
+    destroyEntities(weathers);
+
     names.Clear();
     transforms.Clear();
     groups.Clear();
@@ -522,6 +732,9 @@ void Scene::Clear()
 
     aabb_objects.clear();
     aabb_lights.clear();
+    bvh_objects.Clear();
+    bvh_object_proxies.clear();
+    bvh_entity_proxies.clear();
 }
 
 void Scene::Merge(Scene& other)
@@ -540,21 +753,19 @@ void Scene::Merge(Scene& other)
 
     aabb_objects.insert(aabb_objects.end(), other.aabb_objects.begin(), other.aabb_objects.end());
     aabb_lights.insert(aabb_lights.end(), other.aabb_lights.begin(), other.aabb_lights.end());
+    other.aabb_objects.clear();
+    other.aabb_lights.clear();
+    other.bvh_objects.Clear();
+    other.bvh_object_proxies.clear();
+    other.bvh_entity_proxies.clear();
 }
 
 void Scene::RemoveEntity(ecs::Entity entity, bool recursive, bool removeLinkedEntities)
 {
     // Create a list of all the child entities.
     std::vector<ecs::Entity> childList;
-    for (size_t i = 0; i < hierarchy.Size(); ++i)
-    {
-        const HierarchyComponent& hier = hierarchy[i];
-        if (hier.parentID == entity)
-        {
-            ecs::Entity child = hierarchy.GetEntity(i);
-            childList.push_back(child);
-        }
-    }
+    for (ecs::Entity child = GetFirstChild(entity); child != ecs::INVALID_ENTITY; child = GetNextSibling(child))
+        childList.push_back(child);
 
     // Remove all linked entities
     if (removeLinkedEntities)
@@ -589,6 +800,20 @@ void Scene::RemoveEntity(ecs::Entity entity, bool recursive, bool removeLinkedEn
             ComponentDetach(child);
     }
 
+    // Release the links held by the entity, so the use counts and child
+    // links stay valid without a rebuild after removing it's components.
+    UpdateHierarchyLinks(*this);
+    if (const HierarchyComponent* hier = hierarchy.GetComponent(entity))
+        UnlinkChild(hierarchyLinks, hier->parentID, entity);
+    UpdateUseCounts(*this);
+    if (const ObjectComponent* object = objects.GetComponent(entity))
+        ReleaseUse(meshUseCounts, object->meshID);
+    if (const MeshComponent* mesh = meshes.GetComponent(entity))
+    {
+        for (const auto& subset : mesh->subsets)
+            ReleaseUse(materialUseCounts, subset.materialID);
+    }
+
     names.Remove(entity);
     transforms.Remove(entity);
     groups.Remove(entity);
@@ -600,12 +825,18 @@ void Scene::RemoveEntity(ecs::Entity entity, bool recursive, bool removeLinkedEn
     cameras.Remove(entity);
     animations.Remove(entity);
     weathers.Remove(entity);
+    useCountsObjectsVersion = objects.GetVersion();
+    useCountsMeshesVersion = meshes.GetVersion();
+    hierarchyLinksVersion = hierarchy.GetVersion();
+
+    ecs::DestroyEntity(entity);
 }
 
 void Scene::RemoveUnusedEntities()
 {
-    // Remove unused meshes.
-    for (size_t i = 0; i < meshes.Size(); ++i)
+    // Remove unused meshes. Iterate backwards as removing swaps in the last
+    // component, which has then already been visited.
+    for (size_t i = meshes.Size(); i-- > 0;)
     {
         ecs::Entity meshID = meshes.GetEntity(i);
         if (GetMeshUseCount(meshID) == 0)
@@ -613,7 +844,7 @@ void Scene::RemoveUnusedEntities()
     }
 
     // Remove unused materials.
-    for (size_t i = 0; i < materials.Size(); ++i)
+    for (size_t i = materials.Size(); i-- > 0;)
     {
         ecs::Entity materialID = materials.GetEntity(i);
         if (GetMaterialUseCount(materialID) == 0)
@@ -621,6 +852,16 @@ void Scene::RemoveUnusedEntities()
     }
 }
 
+XMMATRIX Scene::GetWorldMatrix(size_t transformIndex) const
+{
+    // The streams are out of sync after a structural change until the next
+    // update, transforms created since then have their world matrix set by
+    // UpdateTransform().
+    if (transformStreamsActive && transformStreamsVersion == transforms.GetVersion())
+        return transformStreams.GetWorldMatrix((uint32_t)transformIndex);
+    return transforms[transformIndex].world;
+}
+
 void Scene::Serialize(Serializer& ser)
 {
     constexpr uint64_t LEAST_SUPPORTED_VERSION = 4;
@@ -654,48 +895,205 @@ void Scene::Serialize(Serializer& ser)
     weathers.Serialize(ser, context);
 }
 
+// Pick up the world matrix change of a transform for the current update.
+static bool ConsumeWorldUpdated(TransformComponent& transform)
+{
+    if (!HasFlag(transform.flags, TransformComponent::Flags::WorldUpdatedBit))
+        return false;
+
+    SetFlag(transform.flags, TransformComponent::Flags::WorldUpdatedBit, false);
+    return true;
+}
+
 void Scene::RunTransformUpdateSystem(jobsystem::Context& ctx)
 {
-    jobsystem::Dispatch(ctx, (uint32_t)transforms.Size(), r_sceneSubtaskGroupsize.GetValue(), [&] (jobsystem::JobArgs args) {
+    changed_local_transforms.resize(transforms.Size());
+    changed_world_transforms.resize(transforms.Size());
+
+    if (r_sceneTransformStreams.GetValue())
+    {
+        // The streams are indexed like transforms, so they are fully
+        // regathered if any transform was added, removed or moved.
+        const bool rebuilt = !transformStreamsActive || transformStreamsVersion != transforms.GetVersion();
+        transformStreamsActive = true;
+        transformStreamsVersion = transforms.GetVersion();
+        if (rebuilt)
+            transformStreams.Resize((uint32_t)transforms.Size());
+
+        // Each job gathers the changed local transforms of a block into the
+        // streams and computes their world matrices in SIMD batches.
+        jobsystem::ParallelFor(ctx, transformStreams.GetBlockCount(), [&, rebuilt] (jobsystem::JobArgs args) {
+            const uint32_t begin = args.jobIndex * TransformStreams::BLOCK_SIZE;
+            const uint32_t end = std::min(begin + TransformStreams::BLOCK_SIZE, transformStreams.Size());
+            for (uint32_t i = begin; i < end; ++i)
+            {
+                // World matrices updated outside of the scene update were
+                // computed from a changed local transform, pick that up.
+                TransformComponent& transform = transforms[i];
+                const bool worldUpdated = ConsumeWorldUpdated(transform);
+                if (rebuilt || worldUpdated || transform.IsDirty())
+                {
+                    transformStreams.SetLocal(i, transform.scale_local, transform.rotation_local, transform.translation_local);
+                    transform.SetDirty(false);
+                }
+
+                const bool changed = transformStreams.IsDirty(i);
+                changed_local_transforms[i] = changed;
+                changed_world_transforms[i] = changed;
+            }
+
+            transformStreams.UpdateBlock(args.jobIndex);
+            transformStreams.ClearDirty(args.jobIndex);
+        });
+        return;
+    }
+
+    // Switching back from the streams, the world matrices of the components
+    // are stale and must all be recomputed.
+    if (transformStreamsActive)
+    {
+        transformStreamsActive = false;
+        transformStreamsVersion = ~0ull;
+        transformStreams.Resize(0);
+        for (size_t i = 0; i < transforms.Size(); ++i)
+            transforms[i].SetDirty();
+    }
+
+    jobsystem::ParallelFor(ctx, (uint32_t)transforms.Size(), [&] (jobsystem::JobArgs args) {
         TransformComponent& transform = transforms[args.jobIndex];
         transform.UpdateTransform();
+
+        // World matrices updated outside of the scene update is picked up here as well.
+        const bool changed = ConsumeWorldUpdated(transform);
+        changed_local_transforms[args.jobIndex] = changed;
+        changed_world_transforms[args.jobIndex] = changed;
     });
 }
 
-void Scene::RunHierarchyUpdateSystem(jobsystem::Context& ctx)
+// Sort the hierarchy parent before child by grouping the nodes by their depth.
+// Parents without a transform are skipped, linking directly to the closest
+// ancestor having one.
+static void BuildHierarchyLevels(Scene& scene)
 {
-    jobsystem::Dispatch(ctx, (uint32_t)hierarchy.Size(), r_sceneSubtaskGroupsize.GetValue(), [&] (jobsystem::JobArgs args) {
-        const HierarchyComponent& hier = hierarchy[args.jobIndex];
-        ecs::Entity entity = hierarchy.GetEntity(args.jobIndex);
-        TransformComponent* transform = transforms.GetComponent(entity);
+    constexpr uint32_t INVALID_INDEX = Scene::HierarchyNode::INVALID_INDEX;
+    const auto& view = scene.hierarchyTransforms;
+    const uint32_t nodeCount = (uint32_t)view.Size();
 
-        XMMATRIX worldMatrix = {};
-        if (transform != nullptr)
-            worldMatrix = transform->GetLocalMatrix();
+    std::vector<Scene::HierarchyNode> nodes(nodeCount);
+    std::vector<uint32_t> nodeOfTransform(scene.transforms.Size(), INVALID_INDEX);
+    for (uint32_t i = 0; i < nodeCount; ++i)
+    {
+        const uint32_t transformIndex = view[i].Index<TransformComponent>();
+        nodes[i].transformIndex = transformIndex;
+        nodeOfTransform[transformIndex] = i;
 
-        ecs::Entity parentID = hier.parentID;
+        ecs::Entity parentID = scene.hierarchy[view[i].Index<HierarchyComponent>()].parentID;
         while (parentID != ecs::INVALID_ENTITY)
         {
-            const TransformComponent* transformParent = transforms.GetComponent(parentID);
+            const size_t parentIndex = scene.transforms.GetIndex(parentID);
+            if (parentIndex != std::numeric_limits<size_t>::max())
+            {
+                nodes[i].parentTransformIndex = (uint32_t)parentIndex;
+                break;
+            }
 
-            if (transform != nullptr && transformParent != nullptr)
-                worldMatrix *= transformParent->GetLocalMatrix();
+            const HierarchyComponent* hier = scene.hierarchy.GetComponent(parentID);
+            parentID = hier != nullptr ? hier->parentID : ecs::INVALID_ENTITY;
+        }
+    }
 
-            const HierarchyComponent* hierRecursive = hierarchy.GetComponent(parentID);
-            if (hierRecursive != nullptr)
-                parentID = hierRecursive->parentID;
-            else
-                parentID = ecs::INVALID_ENTITY;
+    // Resolve depths iteratively, walking up to the first node with a known depth.
+    std::vector<uint32_t> depths(nodeCount, INVALID_INDEX);
+    std::vector<uint32_t> stack;
+    uint32_t levelCount = 0;
+    for (uint32_t i = 0; i < nodeCount; ++i)
+    {
+        uint32_t node = i;
+        while (depths[node] == INVALID_INDEX)
+        {
+            const uint32_t parent = nodes[node].parentTransformIndex;
+            const uint32_t parentNode = parent != INVALID_INDEX ? nodeOfTransform[parent] : INVALID_INDEX;
+            if (parentNode == INVALID_INDEX)
+            {
+                depths[node] = 0;
+                break;
+            }
+
+            assert(stack.size() < nodeCount && "cycle in the scene hierarchy");
+            stack.push_back(node);
+            node = parentNode;
         }
 
-        if (transform != nullptr)
-            transform->world = worldMatrix;
-    });
+        for (uint32_t depth = depths[node]; !stack.empty(); stack.pop_back())
+            depths[stack.back()] = ++depth;
+
+        levelCount = std::max(levelCount, depths[i] + 1);
+    }
+
+    // Counting sort by depth.
+    scene.hierarchy_levels.assign(levelCount + 1, 0);
+    for (uint32_t depth : depths)
+        scene.hierarchy_levels[depth + 1]++;
+    for (uint32_t level = 0; level < levelCount; ++level)
+        scene.hierarchy_levels[level + 1] += scene.hierarchy_levels[level];
+
+    std::vector<uint32_t> offsets(scene.hierarchy_levels.begin(), scene.hierarchy_levels.end() - 1);
+    scene.hierarchy_order.resize(nodeCount);
+    for (uint32_t i = 0; i < nodeCount; ++i)
+        scene.hierarchy_order[offsets[depths[i]]++] = nodes[i];
+}
+
+// Update the parented world matrices one hierarchy level at a time, so every
+// node can use the final world matrix of it's parent. A node is only updated
+// if it, or it's parent, changed during this update.
+static jobsystem::AsyncTask UpdateHierarchyLevels(Scene& scene, bool rebuilt, jobsystem::Priority priority)
+{
+    for (size_t level = 0; level + 1 < scene.hierarchy_levels.size(); ++level)
+    {
+        const uint32_t begin = scene.hierarchy_levels[level];
+        const uint32_t end = scene.hierarchy_levels[level + 1];
+
+        jobsystem::Context ctx;
+        ctx.priority = priority;
+        jobsystem::ParallelFor(ctx, end - begin, [&scene, begin, rebuilt] (jobsystem::JobArgs args) {
+            const Scene::HierarchyNode& node = scene.hierarchy_order[begin + args.jobIndex];
+            const bool hasParent = node.parentTransformIndex != Scene::HierarchyNode::INVALID_INDEX;
+            const bool changed = rebuilt ||
+                scene.changed_local_transforms[node.transformIndex] ||
+                (hasParent && scene.changed_world_transforms[node.parentTransformIndex]);
+            if (!changed)
+                return;
+
+            const bool streams = scene.transformStreamsActive;
+            XMMATRIX worldMatrix = streams ?
+                scene.transformStreams.GetLocalMatrix(node.transformIndex) :
+                scene.transforms[node.transformIndex].GetLocalMatrix();
+            if (hasParent)
+                worldMatrix *= scene.GetWorldMatrix(node.parentTransformIndex);
+
+            if (streams)
+                scene.transformStreams.SetWorld(node.transformIndex, worldMatrix);
+            else
+                scene.transforms[node.transformIndex].world = worldMatrix;
+            scene.changed_world_transforms[node.transformIndex] = 1;
+        });
+        co_await ctx;
+    }
+}
+
+void Scene::RunHierarchyUpdateSystem(jobsystem::Context& ctx)
+{
+    const bool rebuilt = hierarchyTransforms.Update();
+    if (rebuilt)
+        BuildHierarchyLevels(*this);
+
+    if (!hierarchy_order.empty())
+        jobsystem::Spawn(ctx, UpdateHierarchyLevels(*this, rebuilt, ctx.priority));
 }
 
 void Scene::RunMeshUpdateSystem(jobsystem::Context& ctx)
 {
-    jobsystem::Dispatch(ctx, (uint32_t)meshes.Size(), r_sceneSubtaskGroupsize.GetValue(), [&] (jobsystem::JobArgs args) {
+    jobsystem::ParallelFor(ctx, (uint32_t)meshes.Size(), [&] (jobsystem::JobArgs args) {
         ecs::Entity entity = meshes.GetEntity(args.jobIndex);
         MeshComponent& mesh = meshes[args.jobIndex];
 
@@ -711,42 +1109,139 @@ void Scene::RunMeshUpdateSystem(jobsystem::Context& ctx)
 
 void Scene::RunObjectUpdateSystem(jobsystem::Context& ctx)
 {
-    aabb_objects.resize(objects.Size());
+    // Bounding boxes are only recomputed if the world matrix or the mesh
+    // changed, or if any component index might have moved.
+    const bool meshesChanged = meshes.GetVersion() != objectMeshesVersion;
+    objectMeshesVersion = meshes.GetVersion();
+    const bool rebuilt = objectTransforms.Update() || meshesChanged;
+
+    // Objects without a mesh or a transform are left with an invalid box,
+    // so they are kept out of the object BVH.
+    AxisAlignedBox invalidBox;
+    invalidBox.Invalidate();
+    if (rebuilt)
+    {
+        aabb_objects.assign(objects.Size(), invalidBox);
+        changed_aabb_objects.assign(objects.Size(), 1);
+    }
+    else
+    {
+        aabb_objects.resize(objects.Size(), invalidBox);
+        changed_aabb_objects.assign(objects.Size(), 0);
+    }
+
+    objectTransforms.ParallelEach(ctx, [&, rebuilt] (const decltype(objectTransforms)::Entry& entry, ObjectComponent& object, const TransformComponent& /* transform */) {
+        const uint32_t objectIndex = entry.Index<ObjectComponent>();
+        const size_t meshIndex = meshes.GetIndex(object.meshID);
+        if (meshIndex == std::numeric_limits<size_t>::max())
+        {
+            if (aabb_objects[objectIndex].IsValid())
+            {
+                aabb_objects[objectIndex] = invalidBox;
+                changed_aabb_objects[objectIndex] = 1;
+            }
+            return;
+        }
+
+        const MeshComponent& mesh = meshes[meshIndex];
+        const uint32_t transformIndex = entry.Index<TransformComponent>();
+        const bool changed = rebuilt ||
+            changed_world_transforms[transformIndex] ||
+            object.meshIndex != (uint32_t)meshIndex ||
+            object.meshRevision != mesh.revision;
+
+        object.meshIndex = (uint32_t)meshIndex;
+        object.meshRevision = mesh.revision;
+        object.transformIndex = (int32_t)transformIndex;
+        if (!changed)
+            return;
+
+        aabb_objects[objectIndex] = mesh.aabb.IsValid() ? mesh.aabb.Transform(GetWorldMatrix(transformIndex)) : invalidBox;
+        changed_aabb_objects[objectIndex] = 1;
+    });
+}
+
+void Scene::RunObjectBVHUpdateSystem(jobsystem::Context& /* ctx */)
+{
+    constexpr uint32_t INVALID_NODE = DynamicBVH::INVALID_NODE;
 
-    jobsystem::Dispatch(ctx, (uint32_t)objects.Size(), r_sceneSubtaskGroupsize.GetValue(), [&] (jobsystem::JobArgs args) {
-        ecs::Entity entity = objects.GetEntity(args.jobIndex);
-        ObjectComponent& object = objects[args.jobIndex];
+    // Only added and removed objects change the tree structure, leaves of
+    // objects moved to another index just get their user data updated.
+    if (bvhObjectsVersion != objects.GetVersion())
+    {
+        bvhObjectsVersion = objects.GetVersion();
+        for (auto it = bvh_entity_proxies.begin(); it != bvh_entity_proxies.end();)
+        {
+            if (!objects.Contains(it->first))
+            {
+                if (it->second != INVALID_NODE)
+                    bvh_objects.Remove(it->second);
+                it = bvh_entity_proxies.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
 
-        if (object.meshID != ecs::INVALID_ENTITY && meshes.Contains(object.meshID) && transforms.Contains(entity))
+        bvh_object_proxies.resize(objects.Size());
+        for (uint32_t objectIndex = 0; objectIndex < (uint32_t)objects.Size(); ++objectIndex)
         {
-            object.meshIndex = (uint32_t)meshes.GetIndex(object.meshID);
-            const MeshComponent& mesh = meshes[object.meshIndex];
+            const auto it = bvh_entity_proxies.try_emplace(objects.GetEntity(objectIndex), INVALID_NODE).first;
+            if (it->second != INVALID_NODE)
+                bvh_objects.SetUserData(it->second, objectIndex);
+            bvh_object_proxies[objectIndex] = it->second;
+        }
+    }
 
-            object.transformIndex = (int32_t)transforms.GetIndex(entity);
-            const TransformComponent& transform = transforms[object.transformIndex];
+    // Leaves are only inserted for valid boxes, as an inverted or infinite
+    // box would skew the surface area heuristic of every later insertion.
+    // Leaves are only moved in the tree if the box left it's fattened box.
+    for (uint32_t objectIndex = 0; objectIndex < (uint32_t)changed_aabb_objects.size(); ++objectIndex)
+    {
+        if (!changed_aabb_objects[objectIndex])
+            continue;
 
-            AxisAlignedBox& aabb = aabb_objects[args.jobIndex];
-            aabb = mesh.aabb.Transform(transform.world);
+        const AxisAlignedBox& aabb = aabb_objects[objectIndex];
+        uint32_t& proxy = bvh_object_proxies[objectIndex];
+        if (proxy == INVALID_NODE)
+        {
+            if (!aabb.IsValid())
+                continue;
+            proxy = bvh_objects.Insert(aabb, objectIndex);
         }
-    });
+        else if (!aabb.IsValid())
+        {
+            bvh_objects.Remove(proxy);
+            proxy = INVALID_NODE;
+        }
+        else
+        {
+            bvh_objects.Update(proxy, aabb);
+            continue;
+        }
+
+        bvh_entity_proxies[objects.GetEntity(objectIndex)] = proxy;
+    }
 }
 
 void Scene::RunLightUpdateSystem(jobsystem::Context& ctx)
 {
     aabb_lights.resize(lights.Size());
 
-    jobsystem::Dispatch(ctx, (uint32_t)lights.Size(), r_sceneSubtaskGroupsize.GetValue(), [&] (jobsystem::JobArgs args) {
-        LightComponent& light = lights[args.jobIndex];
-        const ecs::Entity entity = lights.GetEntity(args.jobIndex);
-        if (!transforms.Contains(entity))
-            return;
-        const TransformComponent& transform = *transforms.GetComponent(entity);
-        AxisAlignedBox& aabb = aabb_lights[args.jobIndex];
-
-        XMVECTOR S, R, T;
-        XMMatrixDecompose(&S, &R, &T, transform.world);
-        XMStoreFloat3(&light.position, T);
+    // The light position is only extracted from moved lights, while the
+    // cheap aabb is always updated as the range might have been edited.
+    const bool rebuilt = lightTransforms.Update();
+    lightTransforms.ParallelEach(ctx, [&, rebuilt] (const decltype(lightTransforms)::Entry& entry, LightComponent& light, const TransformComponent& /* transform */) {
+        const uint32_t transformIndex = entry.Index<TransformComponent>();
+        if (rebuilt || changed_world_transforms[transformIndex])
+        {
+            XMVECTOR S, R, T;
+            XMMatrixDecompose(&S, &R, &T, GetWorldMatrix(transformIndex));
+            XMStoreFloat3(&light.position, T);
+        }
 
+        AxisAlignedBox& aabb = aabb_lights[entry.Index<LightComponent>()];
         switch (light.type)
         {
         case LightType::Point:
@@ -761,180 +1256,320 @@ void Scene::RunLightUpdateSystem(jobsystem::Context& ctx)
 
 void Scene::RunCameraUpdateSystem(jobsystem::Context& ctx)
 {
-    jobsystem::Dispatch(ctx, (uint32_t)cameras.Size(), r_sceneSubtaskGroupsize.GetValue(), [&] (jobsystem::JobArgs args) {
+    jobsystem::ParallelFor(ctx, (uint32_t)cameras.Size(), [&] (jobsystem::JobArgs args) {
         CameraComponent& camera = cameras[args.jobIndex];
         camera.UpdateCamera();
     });
 }
 
+// Find the first keyframe > time, starting from the cursor of the last
+// update. Only a few keyframes are stepped over before falling back to a
+// binary search, so seeking the timer doesn't walk the whole timeline.
+[[nodiscard]] static uint32_t SeekKeyframe(const std::vector<float>& times, float time, uint32_t cursor)
+{
+    constexpr uint32_t MAX_LINEAR_STEPS = 4;
+    const uint32_t count = (uint32_t)times.size();
+    cursor = std::min(cursor, count);
+    for (uint32_t i = 0; i < MAX_LINEAR_STEPS; ++i)
+    {
+        if (cursor < count && times[cursor] <= time)
+            ++cursor;
+        else if (cursor > 0 && times[cursor - 1] > time)
+            --cursor;
+        else
+            return cursor;
+    }
+
+    return (uint32_t)(std::upper_bound(times.begin(), times.end(), time) - times.begin());
+}
+
+// Sample N floats per keyframe between the keyframes of the timeline.
+template <uint32_t N>
+[[nodiscard]] static XMVECTOR SampleKeyframes(const AnimationComponent::Sampler& sampler, const AnimationComponent::Timeline& timeline, bool rotation)
+{
+    static_assert(N == 3 || N == 4);
+    auto load = [&] (uint32_t index) {
+        if constexpr (N == 3)
+            return XMLoadFloat3((const XMFLOAT3*)&sampler.keyframeData[index * N]);
+        else
+            return XMLoadFloat4((const XMFLOAT4*)&sampler.keyframeData[index * N]);
+    };
+
+    const uint32_t rightKeyIndex = timeline.cursor;
+    const uint32_t leftKeyIndex = rightKeyIndex - 1;
+
+    switch (sampler.mode)
+    {
+    case AnimationComponent::Sampler::Mode::Step:
+        // t only reaches 1 at the end of the last interval.
+        assert(sampler.keyframeData.size() == sampler.keyframeTimes.size() * N);
+        return load(timeline.t < 1.0f ? leftKeyIndex : rightKeyIndex);
+    case AnimationComponent::Sampler::Mode::Linear:
+    {
+        assert(sampler.keyframeData.size() == sampler.keyframeTimes.size() * N);
+        const XMVECTOR vLeft = load(leftKeyIndex);
+        const XMVECTOR vRight = load(rightKeyIndex);
+        if (rotation)
+            return XMQuaternionNormalize(XMQuaternionSlerp(vLeft, vRight, timeline.t));
+        return XMVectorLerp(vLeft, vRight, timeline.t);
+    }
+    case AnimationComponent::Sampler::Mode::CubicSpline:
+    {
+        // Keyframes are stored as in-tangent, value, out-tangent.
+        assert(sampler.keyframeData.size() == sampler.keyframeTimes.size() * N * 3);
+        const XMVECTOR vLeft = load(leftKeyIndex * 3 + 1);
+        const XMVECTOR vLeftTanOut = timeline.td * load(leftKeyIndex * 3 + 2);
+        const XMVECTOR vRight = load(rightKeyIndex * 3 + 1);
+        const XMVECTOR vRightTanIn = timeline.td * load(rightKeyIndex * 3 + 0);
+        const XMVECTOR h = XMLoadFloat4(&timeline.hermite);
+        XMVECTOR vAnim = XMVectorMultiply(vLeft, XMVectorSplatX(h));
+        vAnim = XMVectorMultiplyAdd(vLeftTanOut, XMVectorSplatY(h), vAnim);
+        vAnim = XMVectorMultiplyAdd(vRight, XMVectorSplatZ(h), vAnim);
+        vAnim = XMVectorMultiplyAdd(vRightTanIn, XMVectorSplatW(h), vAnim);
+        return rotation ? XMQuaternionNormalize(vAnim) : vAnim;
+    }
+    default:
+        assert(0);
+        return XMVectorZero();
+    }
+}
+
+// Sample each channel into the next pose, at the current animation timer.
+static void SampleAnimation(AnimationComponent& animation)
+{
+    if (animation.samplerTimelines.size() != animation.samplers.size())
+        animation.BuildTimelines();
+
+    // Seek each timeline once, the interpolation weights are then shared
+    // by all samplers using it.
+    for (AnimationComponent::Timeline& timeline : animation.timelines)
+    {
+        const std::vector<float>& times = animation.samplers[timeline.sampler].keyframeTimes;
+        timeline.cursor = SeekKeyframe(times, animation.timer, timeline.cursor);
+
+        // Keyframes are sampled from the left key, so a timer exactly at a
+        // key samples that key. The last key is sampled as the end of the
+        // last interval.
+        if (timeline.cursor == times.size() && times.size() > 1 && animation.timer == times.back())
+            timeline.cursor--;
+        if (timeline.cursor == 0 || timeline.cursor >= times.size())
+            continue;
+
+        const float leftTime = times[timeline.cursor - 1];
+        timeline.td = times[timeline.cursor] - leftTime;
+        timeline.t = (animation.timer - leftTime) / std::max(timeline.td, FLT_EPSILON);
+
+        const float t = timeline.t;
+        const float t2 = t * t;
+        const float t3 = t2 * t;
+        timeline.hermite = XMFLOAT4(2 * t3 - 3 * t2 + 1, t3 - 2 * t2 + t, -2 * t3 + 3 * t2, t3 - t2);
+    }
+
+    // Poses are reset if the channels have changed, so there is nothing to
+    // interpolate from.
+    if (animation.channelPoses.size() != animation.channels.size())
+        animation.channelPoses.assign(animation.channels.size(), {});
+
+    for (size_t i = 0; i < animation.channels.size(); ++i)
+    {
+        const AnimationComponent::Channel& channel = animation.channels[i];
+        AnimationComponent::ChannelPose& pose = animation.channelPoses[i];
+        assert(channel.samplerIndex < (int)animation.samplers.size());
+        const AnimationComponent::Sampler& sampler = animation.samplers[channel.samplerIndex];
+        const AnimationComponent::Timeline& timeline = animation.timelines[animation.samplerTimelines[channel.samplerIndex]];
+        if (timeline.cursor == 0 || timeline.cursor >= sampler.keyframeTimes.size())
+        {
+            pose.valid = false;
+            continue;
+        }
+
+        XMVECTOR value;
+        switch (channel.path)
+        {
+        case AnimationComponent::Channel::Path::Translation:
+        case AnimationComponent::Channel::Path::Scale:
+            value = SampleKeyframes<3>(sampler, timeline, false);
+            break;
+        case AnimationComponent::Channel::Path::Rotation:
+            value = SampleKeyframes<4>(sampler, timeline, true);
+            break;
+        default:
+            assert(0);
+            pose.valid = false;
+            continue;
+        }
+
+        if (pose.valid)
+            pose.prev = pose.next;
+        else
+            XMStoreFloat4(&pose.prev, value);
+        XMStoreFloat4(&pose.next, value);
+        pose.valid = true;
+    }
+}
+
+// Blend the channel poses, interpolated by fraction, into the target transforms.
+static void ApplyAnimation(const AnimationComponent& animation, ecs::ComponentManager<TransformComponent>& transforms, float fraction)
+{
+    for (size_t i = 0; i < animation.channels.size(); ++i)
+    {
+        const AnimationComponent::Channel& channel = animation.channels[i];
+        const AnimationComponent::ChannelPose& pose = animation.channelPoses[i];
+        if (!pose.valid)
+            continue;
+
+        TransformComponent* targetTransform = transforms.GetComponent(channel.target);
+        if (targetTransform == nullptr)
+            continue;
+
+        const XMVECTOR prev = XMLoadFloat4(&pose.prev);
+        const XMVECTOR next = XMLoadFloat4(&pose.next);
+        switch (channel.path)
+        {
+        case AnimationComponent::Channel::Path::Translation:
+        {
+            const XMVECTOR aT = XMLoadFloat3(&targetTransform->translation_local);
+            const XMVECTOR bT = fraction < 1.0f ? XMVectorLerp(prev, next, fraction) : next;
+            const XMVECTOR T = XMVectorLerp(aT, bT, animation.blendAmount);
+            XMStoreFloat3(&targetTransform->translation_local, T);
+        } break;
+        case AnimationComponent::Channel::Path::Rotation:
+        {
+            const XMVECTOR aR = XMLoadFloat4(&targetTransform->rotation_local);
+            const XMVECTOR bR = fraction < 1.0f ? XMQuaternionSlerp(prev, next, fraction) : next;
+            const XMVECTOR R = XMQuaternionSlerp(aR, bR, animation.blendAmount);
+            XMStoreFloat4(&targetTransform->rotation_local, R);
+        } break;
+        case AnimationComponent::Channel::Path::Scale:
+        {
+            const XMVECTOR aS = XMLoadFloat3(&targetTransform->scale_local);
+            const XMVECTOR bS = fraction < 1.0f ? XMVectorLerp(prev, next, fraction) : next;
+            const XMVECTOR S = XMVectorLerp(aS, bS, animation.blendAmount);
+            XMStoreFloat3(&targetTransform->scale_local, S);
+        } break;
+        default:
+            break;
+        }
+
+        targetTransform->SetDirty();
+    }
+}
+
+// Collect the index of each object at or below any of the channel targets
+// in the hierarchy, these are the objects whose visibility and distance
+// decide the update rate of the animation.
+static void CollectAnimationTargets(const Scene& scene, AnimationComponent& animation)
+{
+    animation.targetObjects.clear();
+
+    std::vector<ecs::Entity> stack;
+    for (const AnimationComponent::Channel& channel : animation.channels)
+        stack.push_back(channel.target);
+
+    while (!stack.empty())
+    {
+        const ecs::Entity entity = stack.back();
+        stack.pop_back();
+
+        const size_t objectIndex = scene.objects.GetIndex(entity);
+        if (objectIndex != std::numeric_limits<size_t>::max())
+            animation.targetObjects.push_back((uint32_t)objectIndex);
+
+        for (ecs::Entity child = scene.GetFirstChild(entity); child != ecs::INVALID_ENTITY; child = scene.GetNextSibling(child))
+            stack.push_back(child);
+    }
+
+    // Channels commonly share targets, or target both a node and it's parent.
+    std::sort(animation.targetObjects.begin(), animation.targetObjects.end());
+    animation.targetObjects.erase(std::unique(animation.targetObjects.begin(), animation.targetObjects.end()), animation.targetObjects.end());
+}
+
 void Scene::RunAnimationUpdateSystem(jobsystem::Context& ctx)
 {
     CYB_PROFILE_CPU_SCOPE("Animation");
 
-    jobsystem::Dispatch(ctx, (uint32_t)animations.Size(), r_sceneSubtaskGroupsize.GetValue(), [&] (jobsystem::JobArgs args) {
+    // The hierarchy links are lazily rebuilt on query, so the targets are
+    // collected here rather than from the animation jobs.
+    if (animationTargetsAnimationsVersion != animations.GetVersion() ||
+        animationTargetsObjectsVersion != objects.GetVersion() ||
+        animationTargetsHierarchyVersion != hierarchy.GetVersion())
+    {
+        animationTargetsAnimationsVersion = animations.GetVersion();
+        animationTargetsObjectsVersion = objects.GetVersion();
+        animationTargetsHierarchyVersion = hierarchy.GetVersion();
+        for (size_t i = 0; i < animations.Size(); ++i)
+            CollectAnimationTargets(*this, animations[i]);
+    }
+
+    // Object bounds are from the previous update, as animation runs before
+    // the object system.
+    const CameraComponent& camera = GetCamera();
+    const XMVECTOR cameraPos = XMLoadFloat3(&camera.pos);
+    const bool culling = r_animationCulling.GetValue();
+    const float lodDistance = r_animationLODDistance.GetValue();
+
+    jobsystem::ParallelFor(ctx, (uint32_t)animations.Size(), [&] (jobsystem::JobArgs args) {
         AnimationComponent& animation = animations[args.jobIndex];
         if (!animation.IsPlaying())
             return;
 
         animation.lastUpdateTime = animation.timer;
 
-        for (const AnimationComponent::Channel& channel : animation.channels)
+        // Animations not driving any objects, like camera or light animations,
+        // are always updated at full rate.
+        bool visible = true;
+        float distance = 0.0f;
+        if (!animation.targetObjects.empty())
         {
-            assert(channel.samplerIndex < (int)animation.samplers.size());
-            AnimationComponent::Sampler& sampler = animation.samplers[channel.samplerIndex];
-            if (sampler.keyframeTimes.empty())
-                continue;
-
-            const auto keyframe = std::lower_bound(sampler.keyframeTimes.begin(), sampler.keyframeTimes.end(), animation.timer);
-            if (keyframe == sampler.keyframeTimes.begin() ||
-                keyframe == sampler.keyframeTimes.end())
-                continue;
-            const auto rightKeyIndex = keyframe - sampler.keyframeTimes.begin();
-            const auto leftKeyIndex = rightKeyIndex - 1;
-
-            using Interpolator = std::variant<float, XMFLOAT3, XMFLOAT4>;
-            Interpolator interpolator = {};
-
-            TransformComponent* targetTransform = nullptr;
-            if (channel.path == AnimationComponent::Channel::Path::Translation ||
-                channel.path == AnimationComponent::Channel::Path::Rotation ||
-                channel.path == AnimationComponent::Channel::Path::Scale)
+            visible = false;
+            distance = FLT_MAX;
+            for (uint32_t objectIndex : animation.targetObjects)
             {
-                targetTransform = transforms.GetComponent(channel.target);
-                if (targetTransform == nullptr)
-                    continue;
-
-                switch (channel.path)
+                // Bounds of new objects are not known until the object system has run.
+                if (objectIndex >= aabb_objects.size())
                 {
-                case AnimationComponent::Channel::Path::Translation:
-                    interpolator = targetTransform->translation_local;
-                    break;
-                case AnimationComponent::Channel::Path::Rotation:
-                    interpolator = targetTransform->rotation_local;
-                    break;
-                case AnimationComponent::Channel::Path::Scale:
-                    interpolator = targetTransform->scale_local;
-                    break;
-                default:
+                    visible = true;
+                    distance = 0.0f;
                     break;
                 }
-            }
-            else
-            {
-                assert(0);
-                continue;
-            }
 
-            const float td = (sampler.keyframeTimes[rightKeyIndex] - sampler.keyframeTimes[leftKeyIndex]);
-            const float t = (animation.timer - sampler.keyframeTimes[leftKeyIndex]) / std::max(td, FLT_EPSILON);
+                const AxisAlignedBox& aabb = aabb_objects[objectIndex];
+                if (!aabb.IsValid())
+                    continue;
 
-            // path data interpolation
-            switch (sampler.mode)
-            {
-            case AnimationComponent::Sampler::Mode::Linear:
-                // Linear interpolation method:
-                std::visit([&] (auto& value) {
-                    using T = std::decay_t<decltype(value)>;
-                    if constexpr (std::is_same_v<T, XMFLOAT3>)
-                    {
-                        assert(sampler.keyframeData.size() == sampler.keyframeTimes.size() * 3);
-                        const XMFLOAT3* data = (const XMFLOAT3*)sampler.keyframeData.data();
-                        XMVECTOR vLeft = XMLoadFloat3(&data[leftKeyIndex]);
-                        XMVECTOR vRight = XMLoadFloat3(&data[rightKeyIndex]);
-                        XMVECTOR vAnim = XMVectorLerp(vLeft, vRight, t);
-                        XMStoreFloat3(&value, vAnim);
-                    }
-                    else if constexpr (std::is_same_v<T, XMFLOAT4>)
-                    {
-                        assert(sampler.keyframeData.size() == sampler.keyframeTimes.size() * 4);
-                        const XMFLOAT4* data = (const XMFLOAT4*)sampler.keyframeData.data();
-                        XMVECTOR vLeft = XMLoadFloat4(&data[leftKeyIndex]);
-                        XMVECTOR vRight = XMLoadFloat4(&data[rightKeyIndex]);
-                        XMVECTOR vAnim;
-                        if (channel.path == AnimationComponent::Channel::Path::Rotation)
-                        {
-                            vAnim = XMQuaternionSlerp(vLeft, vRight, t);
-                            vAnim = XMQuaternionNormalize(vAnim);
-                        }
-                        else
-                        {
-                            vAnim = XMVectorLerp(vLeft, vRight, t);
-                        }
-                        XMStoreFloat4(&value, vAnim);
-                    }
-                }, interpolator);
-                break;
-            case AnimationComponent::Sampler::Mode::CubicSpline:
-                // Cubic spline interpolation method:
-                std::visit([&] (auto& value) {
-                    const float t2 = t * t;
-                    const float t3 = t2 * t;
-
-                    using T = std::decay_t<decltype(value)>;
-                    if constexpr (std::is_same_v<T, XMFLOAT3>)
-                    {
-                        assert(sampler.keyframeData.size() == sampler.keyframeTimes.size() * 3 * 3);
-                        const XMFLOAT3* data = (const XMFLOAT3*)sampler.keyframeData.data();
-                        XMVECTOR vLeft = XMLoadFloat3(&data[leftKeyIndex * 3 + 1]);
-                        XMVECTOR vLeftTanOut = dt * XMLoadFloat3(&data[leftKeyIndex * 3 + 2]);
-                        XMVECTOR vRightTanIn = dt * XMLoadFloat3(&data[rightKeyIndex * 3 + 0]);
-                        XMVECTOR vRight = XMLoadFloat3(&data[rightKeyIndex * 3 + 1]);
-                        XMVECTOR vAnim = (2 * t3 - 3 * t2 + 1) * vLeft + (t3 - 2 * t2 + t) * vLeftTanOut + (-2 * t3 + 3 * t2) * vRight + (t3 - t2) * vRightTanIn;
-                        XMStoreFloat3(&value, vAnim);
-                    }
-                    else if constexpr (std::is_same_v<T, XMFLOAT4>)
-                    {
-                        assert(sampler.keyframeData.size() == sampler.keyframeTimes.size() * 4 * 3);
-                        const XMFLOAT4* data = (const XMFLOAT4*)sampler.keyframeData.data();
-                        XMVECTOR vLeft = XMLoadFloat4(&data[leftKeyIndex * 3 + 1]);
-                        XMVECTOR vLeftTanOut = td * XMLoadFloat4(&data[leftKeyIndex * 3 + 2]);
-                        XMVECTOR vRightTanIn = td * XMLoadFloat4(&data[rightKeyIndex * 3 + 0]);
-                        XMVECTOR vRight = XMLoadFloat4(&data[rightKeyIndex * 3 + 1]);
-                        XMVECTOR vAnim = (2 * t3 - 3 * t2 + 1) * vLeft + (t3 - 2 * t2 + t) * vLeftTanOut + (-2 * t3 + 3 * t2) * vRight + (t3 - t2) * vRightTanIn;
-                        if (channel.path == AnimationComponent::Channel::Path::Rotation)
-                        {
-                            vAnim = XMQuaternionNormalize(vAnim);
-                        }
-                        XMStoreFloat4(&value, vAnim);
-                    }
-                }, interpolator);
-                break;
-            default:
-                assert(0);
-                break;
+                visible |= !culling || camera.frustum.IntersectsBoundingBox(aabb);
+                const XMVECTOR closest = XMVectorClamp(cameraPos, aabb.GetMin(), aabb.GetMax());
+                distance = std::min(distance, XMVectorGetX(XMVector3Length(XMVectorSubtract(cameraPos, closest))));
             }
+        }
 
-            if (targetTransform != nullptr)
-            {
-                targetTransform->SetDirty();
+        // Culled animations are still evaluated at the lowest rate, so the
+        // bounds of their objects keep following the pose and they are seen
+        // once moved into view. Becoming visible starts a new evaluation, as
+        // culled animations are applied without interpolation.
+        if (animation.channelPoses.size() != animation.channels.size() || (visible && animation.culled))
+            animation.framesSinceUpdate = 0;
+        animation.culled = !visible;
+
+        // The update interval is only changed once the last evaluated pose
+        // is reached, halving the rate at each doubling of distance.
+        if (animation.framesSinceUpdate == 0)
+        {
+            animation.updateInterval = 1;
+            for (float d = visible ? distance : FLT_MAX; d >= lodDistance && animation.updateInterval < AnimationComponent::MAX_UPDATE_INTERVAL; d *= 0.5f)
+                animation.updateInterval *= 2;
 
-                switch (channel.path)
-                {
-                case AnimationComponent::Channel::Path::Translation:
-                {
-                    const XMVECTOR aT = XMLoadFloat3(&targetTransform->translation_local);
-                    const XMVECTOR bT = XMLoadFloat3(&std::get<XMFLOAT3>(interpolator));
-                    const XMVECTOR T = XMVectorLerp(aT, bT, animation.blendAmount);
-                    XMStoreFloat3(&targetTransform->translation_local, T);
-                } break;
-                case AnimationComponent::Channel::Path::Rotation:
-                {
-                    const XMVECTOR aR = XMLoadFloat4(&targetTransform->rotation_local);
-                    const XMVECTOR bR = XMLoadFloat4(&std::get<XMFLOAT4>(interpolator));
-                    const XMVECTOR R = XMQuaternionSlerp(aR, bR, animation.blendAmount);
-                    XMStoreFloat4(&targetTransform->rotation_local, R);
-                } break;
-                case AnimationComponent::Channel::Path::Scale:
-                {
-                    const XMVECTOR aS = XMLoadFloat3(&targetTransform->scale_local);
-                    const XMVECTOR bS = XMLoadFloat3(&std::get<XMFLOAT3>(interpolator));
-                    const XMVECTOR S = XMVectorLerp(aS, bS, animation.blendAmount);
-                    XMStoreFloat3(&targetTransform->scale_local, S);
-                } break;
-                }
-            }
+            SampleAnimation(animation);
         }
 
+        if (visible)
+            ApplyAnimation(animation, transforms, (float)(animation.framesSinceUpdate + 1) / (float)animation.updateInterval);
+        else if (animation.framesSinceUpdate == 0)
+            ApplyAnimation(animation, transforms, 1.0f);
+
+        if (++animation.framesSinceUpdate >= animation.updateInterval)
+            animation.framesSinceUpdate = 0;
+
         const bool forward = animation.speed > 0;
         const bool timerBeyondEnd = animation.timer > animation.end;
         const bool timerBeforeStart = animation.timer < animation.start;
@@ -959,8 +1594,6 @@ void Scene::RunAnimationUpdateSystem(jobsystem::Context& ctx)
         if (animation.IsPlaying())
             animation.timer += dt * animation.speed;
     });
-
-    jobsystem::Wait(ctx);
 }
 
 void Scene::RunWeatherUpdateSystem(jobsystem::Context& /* ctx */)
@@ -969,6 +1602,45 @@ void Scene::RunWeatherUpdateSystem(jobsystem::Context& /* ctx */)
         weather = weathers[0];
 }
 
+// The BVH tests fattened boxes, so each candidate is also tested against it's
+// exact box. Indexes are checked as objects may have been removed since the
+// last update.
+void Scene::QueryObjects(const Frustum& frustum, std::vector<uint32_t>& objectIndexes) const
+{
+    const size_t objectCount = std::min(objects.Size(), aabb_objects.size());
+    bvh_objects.QueryFrustum(frustum, [&] (uint32_t objectIndex) {
+        if (objectIndex < objectCount && frustum.IntersectsBoundingBox(aabb_objects[objectIndex]))
+            objectIndexes.push_back(objectIndex);
+    });
+}
+
+void Scene::QueryObjects(const AxisAlignedBox& aabb, std::vector<uint32_t>& objectIndexes) const
+{
+    const size_t objectCount = std::min(objects.Size(), aabb_objects.size());
+    bvh_objects.QueryAABB(aabb, [&] (uint32_t objectIndex) {
+        if (objectIndex < objectCount && aabb.Intersects(aabb_objects[objectIndex]))
+            objectIndexes.push_back(objectIndex);
+    });
+}
+
+void Scene::QueryObjects(const XMVECTOR& sphereCenter, float sphereRadius, std::vector<uint32_t>& objectIndexes) const
+{
+    const size_t objectCount = std::min(objects.Size(), aabb_objects.size());
+    bvh_objects.QuerySphere(sphereCenter, sphereRadius, [&] (uint32_t objectIndex) {
+        if (objectIndex < objectCount && aabb_objects[objectIndex].IntersectsSphere(sphereCenter, sphereRadius))
+            objectIndexes.push_back(objectIndex);
+    });
+}
+
+void Scene::QueryObjects(const Ray& ray, std::vector<uint32_t>& objectIndexes) const
+{
+    const size_t objectCount = std::min(objects.Size(), aabb_objects.size());
+    bvh_objects.QueryRay(ray, [&] (uint32_t objectIndex) {
+        if (objectIndex < objectCount && ray.IntersectsBoundingBox(aabb_objects[objectIndex]))
+            objectIndexes.push_back(objectIndex);
+    });
+}
+
 PickResult Pick(const Scene& scene, const Ray& ray)
 {
     CYB_TIMED_FUNCTION();
@@ -977,54 +1649,157 @@ PickResult Pick(const Scene& scene, const Ray& ray)
     const XMVECTOR ray_origin = ray.GetOrigin();
     const XMVECTOR ray_direction = XMVector3Normalize(ray.GetDirection());
 
-    for (size_t objectIndex = 0; objectIndex < scene.objects.Size(); ++objectIndex)
-    {
-        const AxisAlignedBox& aabb = scene.aabb_objects[objectIndex];
-
-        if (!ray.IntersectsBoundingBox(aabb))
-            continue;
+    std::vector<uint32_t> objectIndexes;
+    scene.QueryObjects(ray, objectIndexes);
 
+    for (uint32_t objectIndex : objectIndexes)
+    {
         const ObjectComponent& object = scene.objects[objectIndex];
         if (object.meshID == ecs::INVALID_ENTITY)
             continue;
 
         const MeshComponent* mesh = scene.meshes.GetComponent(object.meshID);
-        const XMMATRIX object_matrix = object.transformIndex >= 0 ? scene.transforms[object.transformIndex].world : XMMatrixIdentity();
+        if (mesh == nullptr)
+            continue;
+
+        const XMMATRIX object_matrix = object.transformIndex >= 0 ? scene.GetWorldMatrix(object.transformIndex) : XMMatrixIdentity();
         const XMMATRIX inv_object_matrix = XMMatrixInverse(nullptr, object_matrix);
         const XMVECTOR ray_origin_local = XMVector3Transform(ray_origin, inv_object_matrix);
         const XMVECTOR ray_direction_local = XMVector3Normalize(XMVector3TransformNormal(ray_direction, inv_object_matrix));
 
-        for (auto& subset : mesh->subsets)
+        float distance = std::numeric_limits<float>::max();
+        if (!mesh->bvh.IntersectRay(ray_origin_local, ray_direction_local, mesh->vertex_positions, mesh->indices, distance))
+            continue;
+
+        const XMVECTOR pos = XMVector3Transform(XMVectorAdd(ray_origin_local, ray_direction_local * distance), object_matrix);
+        distance = Distance(pos, ray_origin);
+        if (distance < result.distance)
         {
-            for (size_t j = 0; j < subset.indexCount; j += 3)
-            {
-                const uint32_t i0 = mesh->indices[subset.indexOffset + j + 0];
-                const uint32_t i1 = mesh->indices[subset.indexOffset + j + 1];
-                const uint32_t i2 = mesh->indices[subset.indexOffset + j + 2];
+            result.entity = scene.objects.GetEntity(objectIndex);
+            XMStoreFloat3(&result.position, pos);
+            result.distance = distance;
+        }
+    }
+
+    return result;
+}
 
-                const XMVECTOR p0 = XMLoadFloat3(&mesh->vertex_positions[i0]);
-                const XMVECTOR p1 = XMLoadFloat3(&mesh->vertex_positions[i1]);
-                const XMVECTOR p2 = XMLoadFloat3(&mesh->vertex_positions[i2]);
+// Trace a packet of rays with normalized directions against all objects,
+// keeping the closest hit of each active ray in results.
+static void RayQueryPacket(const Scene& scene, const XMVECTOR origins[4], const XMVECTOR directions[4], uint32_t activeMask, PickResult results[4])
+{
+    const RayPacket packet(origins, directions);
+    const size_t objectCount = std::min(scene.objects.Size(), scene.aabb_objects.size());
 
-                float distance;
-                XMFLOAT2 bary;
-                if (RayTriangleIntersects(ray_origin_local, ray_direction_local, p0, p1, p2, distance, bary))
-                {
-                    const XMVECTOR pos = XMVector3Transform(XMVectorAdd(ray_origin_local, ray_direction_local * distance), object_matrix);
-                    distance = Distance(pos, ray_origin);
-
-                    if (distance < result.distance)
-                    {
-                        result.entity = scene.objects.GetEntity(objectIndex);
-                        XMStoreFloat3(&result.position, pos);
-                        result.distance = distance;
-                    }
-                }
+    scene.bvh_objects.QueryRayPacket(packet, activeMask, [&] (uint32_t objectIndex, uint32_t mask) {
+        if (objectIndex >= objectCount)
+            return;
+        mask &= packet.IntersectsBoundingBox(scene.aabb_objects[objectIndex]);
+        if (mask == 0)
+            return;
+
+        const ObjectComponent& object = scene.objects[objectIndex];
+        const MeshComponent* mesh = object.meshID != ecs::INVALID_ENTITY ? scene.meshes.GetComponent(object.meshID) : nullptr;
+        if (mesh == nullptr)
+            return;
+
+        const XMMATRIX object_matrix = object.transformIndex >= 0 ? scene.GetWorldMatrix(object.transformIndex) : XMMatrixIdentity();
+        const XMMATRIX inv_object_matrix = XMMatrixInverse(nullptr, object_matrix);
+        XMVECTOR origins_local[4];
+        XMVECTOR directions_local[4];
+        for (uint32_t lane = 0; lane < 4; ++lane)
+        {
+            origins_local[lane] = XMVector3Transform(origins[lane], inv_object_matrix);
+            directions_local[lane] = XMVector3Normalize(XMVector3TransformNormal(directions[lane], inv_object_matrix));
+        }
+
+        XMVECTOR distance = XMVectorReplicate(FLT_MAX);
+        const RayPacket packet_local(origins_local, directions_local);
+        uint32_t hitMask = mesh->bvh.IntersectRayPacket(packet_local, mask, mesh->vertex_positions, mesh->indices, distance);
+        while (hitMask != 0)
+        {
+            const uint32_t lane = (uint32_t)std::countr_zero(hitMask);
+            hitMask &= hitMask - 1;
+
+            const XMVECTOR pos = XMVector3Transform(XMVectorAdd(origins_local[lane], directions_local[lane] * XMVectorGetByIndex(distance, lane)), object_matrix);
+            const float hitDistance = Distance(pos, origins[lane]);
+            if (hitDistance < results[lane].distance)
+            {
+                results[lane].entity = scene.objects.GetEntity(objectIndex);
+                XMStoreFloat3(&results[lane].position, pos);
+                results[lane].distance = hitDistance;
             }
         }
+    });
+}
+
+// Spread the low 9 bits of x to every third bit, for building Morton codes.
+[[nodiscard]] static uint32_t SpreadBits(uint32_t x)
+{
+    x &= 0x1FF;
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x << 8)) & 0x0300F00F;
+    x = (x | (x << 4)) & 0x030C30C3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+void RayQuery(const Scene& scene, std::span<const Ray> rays, std::span<PickResult> results)
+{
+    CYB_TIMED_FUNCTION();
+    assert(results.size() >= rays.size());
+
+    const uint32_t rayCount = (uint32_t)rays.size();
+    if (rayCount == 0)
+        return;
+
+    // Sort the rays by direction octant and then by origin along a Morton
+    // curve, so the rays sharing a packet mostly visit the same nodes. The
+    // ray index is kept in the low bits of the sort key.
+    XMVECTOR originMin = rays[0].GetOrigin();
+    XMVECTOR originMax = originMin;
+    for (const Ray& ray : rays)
+    {
+        originMin = XMVectorMin(originMin, ray.GetOrigin());
+        originMax = XMVectorMax(originMax, ray.GetOrigin());
     }
+    const XMVECTOR originExtent = XMVectorMax(XMVectorSubtract(originMax, originMin), XMVectorSplatEpsilon());
+    const XMVECTOR originScale = XMVectorDivide(XMVectorReplicate(511.0f), originExtent);
 
-    return result;
+    std::vector<uint64_t> sortKeys(rayCount);
+    for (uint32_t i = 0; i < rayCount; ++i)
+    {
+        XMFLOAT3 cell;
+        XMStoreFloat3(&cell, XMVectorMultiply(XMVectorSubtract(rays[i].GetOrigin(), originMin), originScale));
+        const uint32_t octant = GetLaneMask(XMVectorLess(rays[i].GetDirection(), XMVectorZero())) & 0x7;
+        const uint32_t morton = SpreadBits((uint32_t)cell.x) | (SpreadBits((uint32_t)cell.y) << 1) | (SpreadBits((uint32_t)cell.z) << 2);
+        sortKeys[i] = ((uint64_t)((octant << 27) | morton) << 32) | i;
+    }
+    jobsystem::ParallelSort(std::span(sortKeys));
+
+    jobsystem::Context ctx;
+    const uint32_t packetCount = (rayCount + 3) / 4;
+    jobsystem::ParallelFor(ctx, packetCount, [&] (jobsystem::JobArgs args) {
+        const uint32_t first = args.jobIndex * 4;
+        const uint32_t laneCount = std::min(4u, rayCount - first);
+
+        // Unused lanes repeat the first ray, and are masked out.
+        uint32_t rayIndexes[4];
+        XMVECTOR origins[4];
+        XMVECTOR directions[4];
+        for (uint32_t lane = 0; lane < 4; ++lane)
+        {
+            rayIndexes[lane] = (uint32_t)sortKeys[first + (lane < laneCount ? lane : 0)];
+            origins[lane] = rays[rayIndexes[lane]].GetOrigin();
+            directions[lane] = XMVector3Normalize(rays[rayIndexes[lane]].GetDirection());
+        }
+
+        PickResult packetResults[4];
+        RayQueryPacket(scene, origins, directions, (1u << laneCount) - 1, packetResults);
+        for (uint32_t lane = 0; lane < laneCount; ++lane)
+            results[rayIndexes[lane]] = packetResults[lane];
+    });
+    jobsystem::Wait(ctx);
 }
 
 } // namespace cyb::scene
@@ -1,9 +1,13 @@
 #pragma once
 #include <mutex>
+#include <unordered_map>
 #include "core/serializer.h"
 #include "core/intersect.h"
 #include "core/enum_flags.h"
+#include "core/dynamic_bvh.h"
+#include "core/triangle_bvh.h"
 #include "systems/ecs.h"
+#include "systems/transform_streams.h"
 #include "graphics/renderer.h"
 
 namespace cyb::scene {
@@ -20,8 +24,9 @@ struct alignas(16) TransformComponent
 {
     enum class Flags
     {
-        None     = 0,
-        DirtyBit = BIT(0),
+        None            = 0,
+        DirtyBit        = BIT(0),
+        WorldUpdatedBit = BIT(1),   // world matrix changed, not yet picked up by the scene update
     };
 
     Flags flags{ Flags::DirtyBit };
@@ -107,6 +112,8 @@ struct alignas(16) MeshComponent
 
     // non-serialized data
     AxisAlignedBox aabb;
+    uint32_t revision{ 0 };     // incremented every time the render data (and aabb) is rebuilt
+    TriangleBVH bvh;            // triangles of all subsets, used for picking
     rhi::GPUBuffer vertex_buffer_pos;
     rhi::GPUBuffer vertex_buffer_col;
     rhi::GPUBuffer index_buffer;
@@ -115,6 +122,7 @@ struct alignas(16) MeshComponent
     // clear vertex and index data. GPUBuffer's will be left untouched
     void Clear();
     void CreateRenderData();
+    void BuildBVH();
     void ComputeHardNormals();
     void ComputeSmoothNormals();
 
@@ -160,6 +168,7 @@ struct alignas(16) ObjectComponent
 
     // non-serialized data
     uint32_t meshIndex{ ~0u };
+    uint32_t meshRevision{ 0 };          // mesh revision used for the current aabb
     int32_t transformIndex{ -1 };        // only valid for a single frame
 };
 CYB_ENABLE_BITMASK_OPERATORS(ObjectComponent::Flags);
@@ -289,8 +298,42 @@ struct AnimationComponent
     std::vector<Channel> channels;
     std::vector<Sampler> samplers;
 
+    // Samplers with equal keyframe times share a timeline, so the keyframe
+    // lookup and interpolation weights are computed once for all of them.
+    // The cursor is the index of the first keyframe > timer from the last
+    // update, playback is mostly coherent so it's rarely moved far.
+    struct Timeline
+    {
+        uint32_t sampler{ 0 };          // first sampler using the timeline
+        uint32_t cursor{ 0 };
+        float t{ 0.0f };                // normalized time between the keyframes
+        float td{ 0.0f };               // time between the keyframes
+        XMFLOAT4 hermite{};             // cubic spline basis for t
+    };
+
+    // The last two evaluated values of a channel, frames in between
+    // evaluations are interpolated from prev to next.
+    struct ChannelPose
+    {
+        XMFLOAT4 prev{};
+        XMFLOAT4 next{};
+        bool valid{ false };            // channel was sampled in the last evaluation
+    };
+
     // non-serialized attributes:
     float lastUpdateTime{ 0.0f };
+    std::vector<Timeline> timelines;
+    std::vector<uint32_t> samplerTimelines;     // timeline index of each sampler
+
+    // Update rate LOD, picked by the animation system from the distance to
+    // the driven objects. Animations with all driven objects culled are only
+    // evaluated every MAX_UPDATE_INTERVAL frames, without interpolation:
+    static constexpr uint32_t MAX_UPDATE_INTERVAL = 8;
+    uint32_t updateInterval{ 1 };               // frames between evaluations
+    uint32_t framesSinceUpdate{ 0 };
+    bool culled{ false };
+    std::vector<ChannelPose> channelPoses;      // per channel
+    std::vector<uint32_t> targetObjects;        // index of objects at or below the channel targets
 
     [[nodiscard]] constexpr bool IsPlaying() const { return HasFlag(flags, Flag::Playing); }
     [[nodiscard]] constexpr bool IsLooped() const { return HasFlag(flags, Flag::Looped); }
@@ -304,6 +347,10 @@ struct AnimationComponent
     constexpr void SetLooped(bool value) { SetFlag(flags, Flag::Looped, value); if (value) SetFlag(flags, Flag::PingPong, false); }
     constexpr void SetPingPong(bool value) { SetFlag(flags, Flag::PingPong, value); if (value) SetFlag(flags, Flag::Looped, false); }
     void SetPlayOnce() { SetFlag(flags, Flag::Looped, false); SetFlag(flags, Flag::PingPong, false); }
+
+    // Rebuild the sampler timelines, this is done automatically if the number
+    // of samplers has changed, but must be called if keyframe times are edited.
+    void BuildTimelines();
 };
 CYB_ENABLE_BITMASK_OPERATORS(AnimationComponent::Flag);
 
@@ -323,15 +370,91 @@ struct Scene
 
     WeatherComponent weather;   // weathers[0] copy
 
+    // component joins used by the update systems:
+    ecs::View<HierarchyComponent, TransformComponent> hierarchyTransforms{ hierarchy, transforms };
+
+    // Parented transforms sorted parent before child, grouped by depth in the
+    // hierarchy. Rebuilt by RunHierarchyUpdateSystem on hierarchy changes.
+    struct HierarchyNode
+    {
+        static constexpr uint32_t INVALID_INDEX = ~0u;
+        uint32_t transformIndex{ INVALID_INDEX };
+        uint32_t parentTransformIndex{ INVALID_INDEX };   // closest ancestor with a transform
+    };
+    std::vector<HierarchyNode> hierarchy_order;
+    std::vector<uint32_t> hierarchy_levels;     // offset of each level in hierarchy_order, followed by the node count
+    ecs::View<ObjectComponent, TransformComponent> objectTransforms{ objects, transforms };
+    ecs::View<LightComponent, TransformComponent> lightTransforms{ lights, transforms };
+
     // non-serialized attributes:
     float dt{ 0.0f };
     float time{ 0.0f };
     std::mutex lock;
 
+    // Structural changes recorded from any thread, played back at the start of Update().
+    ecs::CommandQueue commands;
+
+    // SoA storage of the local transforms and world matrices, indexed like
+    // transforms. While active, it owns the world matrices and the world of
+    // TransformComponent isn't kept up to date, use GetWorldMatrix() instead.
+    // Enabled with r_sceneTransformStreams, resynced if transforms changed:
+    TransformStreams transformStreams;
+    bool transformStreamsActive{ false };
+    uint64_t transformStreamsVersion{ ~0ull };
+
     // AABB culling streams:
     std::vector<AxisAlignedBox> aabb_objects;
     std::vector<AxisAlignedBox> aabb_lights;
 
+    // Change tracking streams, set to non-zero for components changed during
+    // the current update. Each is valid after the system writing it has finished:
+    std::vector<uint8_t> changed_local_transforms;  // per transform, written by RunTransformUpdateSystem
+    std::vector<uint8_t> changed_world_transforms;  // per transform, local changes propagated by RunHierarchyUpdateSystem
+    std::vector<uint8_t> changed_aabb_objects;      // per object, written by RunObjectUpdateSystem
+    uint64_t objectMeshesVersion{ 0 };
+
+    // Dynamic BVH over aabb_objects with the object index as leaf user data,
+    // written by RunObjectBVHUpdateSystem. Leaves are tracked per entity so
+    // they survive object indexes moving:
+    DynamicBVH bvh_objects;
+    std::vector<uint32_t> bvh_object_proxies;                       // per object
+    std::unordered_map<ecs::Entity, uint32_t> bvh_entity_proxies;   // per object entity
+    uint64_t bvhObjectsVersion{ ~0ull };
+
+    // Reverse reference counts of object meshes and subset materials. Kept up
+    // to date by RemoveEntity() and the link setters, and rebuilt on the next
+    // query if objects or meshes were changed in any other way:
+    mutable std::unordered_map<ecs::Entity, uint32_t> meshUseCounts;
+    mutable std::unordered_map<ecs::Entity, uint32_t> materialUseCounts;
+    mutable uint64_t useCountsObjectsVersion{ ~0ull };
+    mutable uint64_t useCountsMeshesVersion{ ~0ull };
+
+    // Child links of the hierarchy, so a subtree is walked in time linear to
+    // it's size. Kept up to date by ComponentAttach(), ComponentDetach() and
+    // RemoveEntity(), and rebuilt on the next query if hierarchy was changed
+    // in any other way:
+    struct HierarchyLinks
+    {
+        ecs::Entity firstChild{ ecs::INVALID_ENTITY };
+        ecs::Entity lastChild{ ecs::INVALID_ENTITY };
+        ecs::Entity prevSibling{ ecs::INVALID_ENTITY };
+        ecs::Entity nextSibling{ ecs::INVALID_ENTITY };
+    };
+    mutable std::unordered_map<ecs::Entity, HierarchyLinks> hierarchyLinks;
+    mutable uint64_t hierarchyLinksVersion{ ~0ull };
+
+    // Guards the lazy rebuilds of the use counts and hierarchy links, so the
+    // const getters can be called from any thread while the scene isn't being
+    // modified. Both are also rebuilt up front by Update(), so the systems
+    // never wait on a rebuild.
+    mutable std::mutex derivedDataLock;
+
+    // Versions the animation target objects were collected at, they are
+    // recollected by RunAnimationUpdateSystem if any of them changed:
+    uint64_t animationTargetsAnimationsVersion{ ~0ull };
+    uint64_t animationTargetsObjectsVersion{ ~0ull };
+    uint64_t animationTargetsHierarchyVersion{ ~0ull };
+
     void Update(double dt);
     void Clear();
     void Merge(Scene& other);
@@ -372,6 +495,18 @@ struct Scene
     // world position will not be changed
     void ComponentDetach(ecs::Entity entity);
 
+    /**
+     * @brief Get the first child attached to entity, or INVALID_ENTITY if it has
+     *        no children. Walk the rest of the children with GetNextSibling().
+     */
+    ecs::Entity GetFirstChild(ecs::Entity entity) const;
+
+    /**
+     * @brief Get the next child attached to the same parent as child, or
+     *        INVALID_ENTITY if child is the last one.
+     */
+    ecs::Entity GetNextSibling(ecs::Entity child) const;
+
     /**
      * @brief Get number of objects currently using a mash in scene.
      */
@@ -382,12 +517,45 @@ struct Scene
      */
     uint32_t GetMaterialUseCount(ecs::Entity materialID) const;
 
+    /**
+     * @brief Link a mesh to an object, keeping the mesh use counts up to date.
+     */
+    void SetObjectMesh(ObjectComponent& object, ecs::Entity meshID);
+
+    /**
+     * @brief Link a material to a mesh subset, keeping the material use counts up to date.
+     */
+    void SetSubsetMaterial(MeshComponent::MeshSubset& subset, ecs::Entity materialID);
+
+    /**
+     * @brief Force the use counts to be rebuilt on the next query. Needed after
+     *        changing meshID or subset materialID of existing components in place.
+     *        Links set on newly created components are picked up automatically.
+     */
+    void InvalidateUseCounts();
+
+    /**
+     * @brief Append the index of each object whose bounding box intersects the
+     *        query volume. Uses the object BVH, valid after the scene update.
+     */
+    void QueryObjects(const Frustum& frustum, std::vector<uint32_t>& objectIndexes) const;
+    void QueryObjects(const AxisAlignedBox& aabb, std::vector<uint32_t>& objectIndexes) const;
+    void QueryObjects(const XMVECTOR& sphereCenter, float sphereRadius, std::vector<uint32_t>& objectIndexes) const;
+    void QueryObjects(const Ray& ray, std::vector<uint32_t>& objectIndexes) const;
+
+    /**
+     * @brief Get the world matrix of the transform at transformIndex, as
+     *        computed by the last scene update.
+     */
+    [[nodiscard]] XMMATRIX GetWorldMatrix(size_t transformIndex) const;
+
     void Serialize(Serializer& ser);
 
     void RunTransformUpdateSystem(jobsystem::Context& ctx);
     void RunHierarchyUpdateSystem(jobsystem::Context& ctx);
     void RunMeshUpdateSystem(jobsystem::Context& ctx);
     void RunObjectUpdateSystem(jobsystem::Context& ctx);
+    void RunObjectBVHUpdateSystem(jobsystem::Context& ctx);
     void RunLightUpdateSystem(jobsystem::Context& ctx);
     void RunCameraUpdateSystem(jobsystem::Context& ctx);
     void RunAnimationUpdateSystem(jobsystem::Context& ctx);
@@ -417,6 +585,15 @@ struct PickResult
 
 PickResult Pick(const Scene& scene, const Ray& ray);
 
+/**
+ * @brief Find the closest object hit by each ray, results[i] is set for rays[i].
+ *
+ * Rays are sorted by direction and origin, and traced in packets of four
+ * coherent rays on the jobsystem. Only the object BVH and the triangle BVH
+ * of each mesh are used, so no GPU is needed.
+ */
+void RayQuery(const Scene& scene, std::span<const Ray> rays, std::span<PickResult> results);
+
 } // namespace cyb::scene
 
 // scene component serializers
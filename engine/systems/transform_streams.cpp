@@ -0,0 +1,138 @@
+#include <cassert>
+#include "systems/transform_streams.h"
+
+namespace cyb::scene {
+
+static constexpr uint32_t BATCHES_PER_BLOCK = TransformStreams::BLOCK_SIZE / TransformStreams::BATCH_SIZE;
+static constexpr uint64_t BATCH_MASK = (1ull << TransformStreams::BATCH_SIZE) - 1;
+
+void TransformStreams::Resize(uint32_t count)
+{
+    const uint32_t blockCount = (count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    const size_t oldBatchCount = m_batches.size();
+
+    m_batches.resize((size_t)blockCount * BATCHES_PER_BLOCK);
+    m_world.resize((size_t)blockCount * BLOCK_SIZE);
+    m_dirty.resize(blockCount, 0);
+
+    for (size_t i = oldBatchCount; i < m_batches.size(); ++i)
+    {
+        Batch& batch = m_batches[i];
+        for (uint32_t lane = 0; lane < BATCH_SIZE; ++lane)
+        {
+            batch.scaleX[lane] = batch.scaleY[lane] = batch.scaleZ[lane] = 1.0f;
+            batch.rotationX[lane] = batch.rotationY[lane] = batch.rotationZ[lane] = 0.0f;
+            batch.rotationW[lane] = 1.0f;
+            batch.translationX[lane] = batch.translationY[lane] = batch.translationZ[lane] = 0.0f;
+        }
+    }
+
+    // Never leave dirty bits set past the end when shrinking.
+    if (count < m_count && count % BLOCK_SIZE != 0)
+        m_dirty.back() &= (1ull << (count % BLOCK_SIZE)) - 1;
+
+    m_count = count;
+}
+
+void TransformStreams::SetLocal(uint32_t index, const XMFLOAT3& scale, const XMFLOAT4& rotation, const XMFLOAT3& translation)
+{
+    assert(index < m_count);
+    Batch& batch = m_batches[index / BATCH_SIZE];
+    const uint32_t lane = index % BATCH_SIZE;
+    batch.scaleX[lane] = scale.x;
+    batch.scaleY[lane] = scale.y;
+    batch.scaleZ[lane] = scale.z;
+    batch.rotationX[lane] = rotation.x;
+    batch.rotationY[lane] = rotation.y;
+    batch.rotationZ[lane] = rotation.z;
+    batch.rotationW[lane] = rotation.w;
+    batch.translationX[lane] = translation.x;
+    batch.translationY[lane] = translation.y;
+    batch.translationZ[lane] = translation.z;
+
+    m_dirty[index / BLOCK_SIZE] |= 1ull << (index % BLOCK_SIZE);
+}
+
+XMMATRIX TransformStreams::GetLocalMatrix(uint32_t index) const
+{
+    assert(index < m_count);
+    const Batch& batch = m_batches[index / BATCH_SIZE];
+    const uint32_t lane = index % BATCH_SIZE;
+    const XMVECTOR S = XMVectorSet(batch.scaleX[lane], batch.scaleY[lane], batch.scaleZ[lane], 0.0f);
+    const XMVECTOR R = XMVectorSet(batch.rotationX[lane], batch.rotationY[lane], batch.rotationZ[lane], batch.rotationW[lane]);
+    const XMVECTOR T = XMVectorSet(batch.translationX[lane], batch.translationY[lane], batch.translationZ[lane], 0.0f);
+    return XMMatrixScalingFromVector(S) *
+        XMMatrixRotationQuaternion(R) *
+        XMMatrixTranslationFromVector(T);
+}
+
+void TransformStreams::UpdateBlock(uint32_t block)
+{
+    const uint64_t dirty = m_dirty[block];
+    if (dirty == 0)
+        return;
+
+    const XMVECTOR one = XMVectorSplatOne();
+    for (uint32_t i = 0; i < BATCHES_PER_BLOCK; ++i)
+    {
+        if (((dirty >> (i * BATCH_SIZE)) & BATCH_MASK) == 0)
+            continue;
+
+        const size_t batchIndex = (size_t)block * BATCHES_PER_BLOCK + i;
+        const Batch& batch = m_batches[batchIndex];
+        const XMVECTOR sx = XMLoadFloat4A((const XMFLOAT4A*)batch.scaleX);
+        const XMVECTOR sy = XMLoadFloat4A((const XMFLOAT4A*)batch.scaleY);
+        const XMVECTOR sz = XMLoadFloat4A((const XMFLOAT4A*)batch.scaleZ);
+        const XMVECTOR qx = XMLoadFloat4A((const XMFLOAT4A*)batch.rotationX);
+        const XMVECTOR qy = XMLoadFloat4A((const XMFLOAT4A*)batch.rotationY);
+        const XMVECTOR qz = XMLoadFloat4A((const XMFLOAT4A*)batch.rotationZ);
+        const XMVECTOR qw = XMLoadFloat4A((const XMFLOAT4A*)batch.rotationW);
+
+        // Rotation matrix from quaternion, matching XMMatrixRotationQuaternion().
+        const XMVECTOR x2 = XMVectorAdd(qx, qx);
+        const XMVECTOR y2 = XMVectorAdd(qy, qy);
+        const XMVECTOR z2 = XMVectorAdd(qz, qz);
+        const XMVECTOR xx = XMVectorMultiply(qx, x2);
+        const XMVECTOR yy = XMVectorMultiply(qy, y2);
+        const XMVECTOR zz = XMVectorMultiply(qz, z2);
+        const XMVECTOR xy = XMVectorMultiply(qx, y2);
+        const XMVECTOR xz = XMVectorMultiply(qx, z2);
+        const XMVECTOR yz = XMVectorMultiply(qy, z2);
+        const XMVECTOR wx = XMVectorMultiply(qw, x2);
+        const XMVECTOR wy = XMVectorMultiply(qw, y2);
+        const XMVECTOR wz = XMVectorMultiply(qw, z2);
+
+        const XMVECTOR r00 = XMVectorSubtract(one, XMVectorAdd(yy, zz));
+        const XMVECTOR r01 = XMVectorAdd(xy, wz);
+        const XMVECTOR r02 = XMVectorSubtract(xz, wy);
+        const XMVECTOR r10 = XMVectorSubtract(xy, wz);
+        const XMVECTOR r11 = XMVectorSubtract(one, XMVectorAdd(xx, zz));
+        const XMVECTOR r12 = XMVectorAdd(yz, wx);
+        const XMVECTOR r20 = XMVectorAdd(xz, wy);
+        const XMVECTOR r21 = XMVectorSubtract(yz, wx);
+        const XMVECTOR r22 = XMVectorSubtract(one, XMVectorAdd(xx, yy));
+
+        // World = Scale * Rotation * Translation, stored transposed as 3x4.
+        // Each vector holds one matrix element for all transforms in the batch,
+        // transposing turns them into one matrix row per transform.
+        const XMMATRIX row0 = XMMatrixTranspose(XMMATRIX(
+            XMVectorMultiply(sx, r00), XMVectorMultiply(sy, r10), XMVectorMultiply(sz, r20),
+            XMLoadFloat4A((const XMFLOAT4A*)batch.translationX)));
+        const XMMATRIX row1 = XMMatrixTranspose(XMMATRIX(
+            XMVectorMultiply(sx, r01), XMVectorMultiply(sy, r11), XMVectorMultiply(sz, r21),
+            XMLoadFloat4A((const XMFLOAT4A*)batch.translationY)));
+        const XMMATRIX row2 = XMMatrixTranspose(XMMATRIX(
+            XMVectorMultiply(sx, r02), XMVectorMultiply(sy, r12), XMVectorMultiply(sz, r22),
+            XMLoadFloat4A((const XMFLOAT4A*)batch.translationZ)));
+
+        XMFLOAT3X4A* world = &m_world[batchIndex * BATCH_SIZE];
+        for (uint32_t lane = 0; lane < BATCH_SIZE; ++lane)
+        {
+            XMStoreFloat4A((XMFLOAT4A*)world[lane].m[0], row0.r[lane]);
+            XMStoreFloat4A((XMFLOAT4A*)world[lane].m[1], row1.r[lane]);
+            XMStoreFloat4A((XMFLOAT4A*)world[lane].m[2], row2.r[lane]);
+        }
+    }
+}
+
+} // namespace cyb::scene
@@ -0,0 +1,99 @@
+#pragma once
+#include <bit>
+#include <cstdint>
+#include <vector>
+#include "core/mathlib.h"
+
+namespace cyb::scene {
+
+/**
+ * @brief Structure-of-arrays storage for local transforms, computing world
+ *        matrices in SIMD batches.
+ *
+ * Local scale, rotation and translation are stored in batches of BATCH_SIZE
+ * transforms with each transform in it's own SIMD lane, so a whole batch of
+ * world matrices is computed with a handful of vector instructions and no
+ * matrix multiplications. World matrices are stored as 3x4 affine matrices,
+ * load them with GetWorldMatrix(). Parented world matrices are written back
+ * with SetWorld() once the parent has been resolved.
+ *
+ * Transforms are grouped into blocks of BLOCK_SIZE sharing a single word of
+ * the dirty bitset. Different blocks can be set and updated in parallel.
+ */
+class TransformStreams
+{
+public:
+    static constexpr uint32_t BATCH_SIZE = 4;       // transforms per SIMD batch
+    static constexpr uint32_t BLOCK_SIZE = 64;      // transforms per dirty bitset word
+
+    /**
+     * @brief Resize the streams to hold count transforms. Added transforms
+     *        are set to identity and are not marked dirty.
+     */
+    void Resize(uint32_t count);
+
+    [[nodiscard]] uint32_t Size() const { return m_count; }
+    [[nodiscard]] uint32_t GetBlockCount() const { return (uint32_t)m_dirty.size(); }
+
+    /**
+     * @brief Set the local transform and mark it dirty. Transforms within the
+     *        same block must not be set concurrently.
+     */
+    void SetLocal(uint32_t index, const XMFLOAT3& scale, const XMFLOAT4& rotation, const XMFLOAT3& translation);
+
+    [[nodiscard]] bool IsDirty(uint32_t index) const
+    {
+        return (m_dirty[index / BLOCK_SIZE] >> (index % BLOCK_SIZE)) & 1;
+    }
+
+    /**
+     * @brief Compute the world matrix of all the dirty transforms within block.
+     *        The dirty bits are left untouched.
+     */
+    void UpdateBlock(uint32_t block);
+
+    // Invoke func(index) for each dirty transform within block.
+    template <typename F>
+    void ForEachDirty(uint32_t block, F&& func) const
+    {
+        uint64_t dirty = m_dirty[block];
+        while (dirty != 0)
+        {
+            func(block * BLOCK_SIZE + (uint32_t)std::countr_zero(dirty));
+            dirty &= dirty - 1;
+        }
+    }
+
+    void ClearDirty(uint32_t block) { m_dirty[block] = 0; }
+
+    // Compute the local matrix of a single transform from it's lane.
+    [[nodiscard]] XMMATRIX GetLocalMatrix(uint32_t index) const;
+
+    [[nodiscard]] const XMFLOAT3X4A& GetWorld(uint32_t index) const { return m_world[index]; }
+    [[nodiscard]] XMMATRIX GetWorldMatrix(uint32_t index) const { return XMLoadFloat3x4A(&m_world[index]); }
+
+    // Overwrite the world matrix, which must be affine.
+    void SetWorld(uint32_t index, const XMMATRIX& world) { XMStoreFloat3x4A(&m_world[index], world); }
+
+private:
+    struct alignas(16) Batch
+    {
+        float scaleX[BATCH_SIZE];
+        float scaleY[BATCH_SIZE];
+        float scaleZ[BATCH_SIZE];
+        float rotationX[BATCH_SIZE];
+        float rotationY[BATCH_SIZE];
+        float rotationZ[BATCH_SIZE];
+        float rotationW[BATCH_SIZE];
+        float translationX[BATCH_SIZE];
+        float translationY[BATCH_SIZE];
+        float translationZ[BATCH_SIZE];
+    };
+
+    uint32_t m_count{ 0 };
+    std::vector<Batch> m_batches;           // padded to whole blocks
+    std::vector<XMFLOAT3X4A> m_world;       // padded to whole blocks
+    std::vector<uint64_t> m_dirty;          // one bit per transform
+};
+
+} // namespace cyb::scene